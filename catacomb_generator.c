@@ -3,110 +3,176 @@
     Generates a random catacomb map and saves it to a file.
 */
 
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-int generate_catacomb_map(int width, int height);
-void save_map_to_file(const char *filename, int width, int height);
-int random_number_range(int min, int max);
-int random_bool();
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
-int** map; // dynamic 2D array for the catacomb map
+#include "catamap.h"
+#include "catarng.h"
 
-// Connect disconnected components using BFS
-void connect_components(int width, int height) {
-    int visited[height][width];
-    memset(visited, 0, sizeof(visited));
+int generate_catacomb_map(struct catamap *map, struct catarng *rng, int width, int height);
+int connect_components(struct catamap *map, int width, int height);
+int save_map_to_file(const struct catamap *map, const char *filename);
+void print_map_stats(const struct catamap *map);
+int generate_batch(int count, int width, int height, const char *prefix, uint64_t seed, int threads);
+
+// Tile of the flat map grid (one byte per tile) that the surrounding function works on
+#define MAP_AT(x, y) CATAMAP_CELL(map, (x), (y))
+
+// Connect disconnected components
+// A single BFS pass over the map finds every floor region and records its first tile
+// (in scan order) as the region's representative. The regions are then chained together
+// by carving a corridor between each pair of consecutive representatives.
+// All working memory is on the heap: a visited bitmap, a BFS queue that only keeps the
+// current frontier, and the list of representatives.
+int connect_components(struct catamap *map, int width, int height) {
+    size_t tile_count = (size_t)width * height;
+    uint64_t *visited = calloc((tile_count + 63) / 64, sizeof(uint64_t));
+    size_t queue_capacity = 1024, queue_front = 0, queue_rear = 0;
+    uint32_t *queue = malloc(queue_capacity * sizeof(uint32_t));
+    size_t rep_capacity = 64, rep_count = 0;
+    uint32_t *reps = malloc(rep_capacity * sizeof(uint32_t));
+    if (visited == NULL || queue == NULL || reps == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(visited);
+        free(queue);
+        free(reps);
+        return 1; // error
+    }
+
+    // Label pass: each unvisited floor tile starts a new region
     for (int y = 1; y < height - 1; y++) {
         for (int x = 1; x < width - 1; x++) {
-            if (map[y][x] == '0' && !visited[y][x]) {
-                // Start BFS from this floor tile
-                int queue[height * width][2];
-                int front = 0, rear = 0;
-                queue[rear][0] = y;
-                queue[rear][1] = x;
-                rear++;
-                visited[y][x] = 1;
-                while (front < rear) {
-                    int cy = queue[front][0];
-                    int cx = queue[front][1];
-                    front++;
-                    // Check orthogonal neighbors
-                    int dirs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
-                    for (int d = 0; d < 4; d++) {
-                        int ny = cy + dirs[d][0];
-                        int nx = cx + dirs[d][1];
-                        if (ny >= 0 && ny < height && nx >= 0 && nx < width && map[ny][nx] == '0' && !visited[ny][nx]) {
-                            visited[ny][nx] = 1;
-                            queue[rear][0] = ny;
-                            queue[rear][1] = nx;
-                            rear++;
-                        }
-                    }
+            uint32_t start = (uint32_t)((size_t)y * width + x);
+            if (MAP_AT(x, y) != TILE_FLOOR || (visited[start >> 6] >> (start & 63) & 1)) continue;
+            if (rep_count == rep_capacity) {
+                rep_capacity *= 2;
+                uint32_t *grown = realloc(reps, rep_capacity * sizeof(uint32_t));
+                if (grown == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    free(visited);
+                    free(queue);
+                    free(reps);
+                    return 1; // error
                 }
-                // If this is not the first component, connect it to the previous one
-                // For simplicity, connect to the leftmost floor tile in the first component
-                if (rear > 1) { // More than one tile, but to connect components, we need to find unvisited floors
-                    // BFS marks one component; we need to find another unvisited floor and carve a path
-                    // After marking one component, find the next unvisited floor and carve a path
-                    for (int yy = 1; yy < height - 1; yy++) {
-                        for (int xx = 1; xx < width - 1; xx++) {
-                            if (map[yy][xx] == '0' && !visited[yy][xx]) {
-                                // Carve a simple path from (y,x) to (yy,xx) - horizontal then vertical
-                                int start_x = (x < xx) ? x : xx;
-                                int end_x = (x > xx) ? x : xx;
-                                int start_y = (y < yy) ? y : yy;
-                                int end_y = (y > yy) ? y : yy;
-                                for (int px = start_x; px <= end_x; px++) map[y][px] = '0';
-                                for (int py = start_y; py <= end_y; py++) map[py][xx] = '0';
-                                // Mark the new component as visited (simplified)
-                                visited[yy][xx] = 1;
-                                goto next_component; // Break out
+                reps = grown;
+            }
+            reps[rep_count++] = start;
+
+            // BFS over the region
+            queue_front = queue_rear = 0;
+            queue[queue_rear++] = start;
+            visited[start >> 6] |= (uint64_t)1 << (start & 63);
+            while (queue_front < queue_rear) {
+                uint32_t current = queue[queue_front++];
+                int cy = (int)(current / (uint32_t)width);
+                int cx = (int)(current - (uint32_t)cy * (uint32_t)width);
+                // Check orthogonal neighbors
+                int dirs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+                for (int d = 0; d < 4; d++) {
+                    int ny = cy + dirs[d][0];
+                    int nx = cx + dirs[d][1];
+                    if (ny < 0 || ny >= height || nx < 0 || nx >= width || MAP_AT(nx, ny) != TILE_FLOOR) continue;
+                    uint32_t next = (uint32_t)((size_t)ny * width + nx);
+                    if (visited[next >> 6] >> (next & 63) & 1) continue;
+                    visited[next >> 6] |= (uint64_t)1 << (next & 63);
+                    if (queue_rear == queue_capacity) {
+                        // Slide the frontier back to the start, or grow if it fills the queue
+                        if (queue_front > 0) {
+                            memmove(queue, queue + queue_front, (queue_rear - queue_front) * sizeof(uint32_t));
+                            queue_rear -= queue_front;
+                            queue_front = 0;
+                        } else {
+                            queue_capacity *= 2;
+                            uint32_t *grown = realloc(queue, queue_capacity * sizeof(uint32_t));
+                            if (grown == NULL) {
+                                fprintf(stderr, "Memory allocation failed\n");
+                                free(visited);
+                                free(queue);
+                                free(reps);
+                                return 1; // error
                             }
+                            queue = grown;
                         }
                     }
-                    next_component:;
+                    queue[queue_rear++] = next;
                 }
             }
         }
     }
-}
 
-// map generation
-int generate_catacomb_map(int width, int height) {
-    printf("Generating catacomb map of size %dx%d\n", width, height);
-    // allocate memory for the map
-    map = (int **)malloc(height * sizeof(int *));
-    for (int i = 0; i < height; i++) {
-        map[i] = (int *)malloc(width * sizeof(int));
+    // Join pass: carve a path from each representative to the next - horizontal then vertical
+    for (size_t r = 1; r < rep_count; r++) {
+        int y = (int)(reps[r - 1] / (uint32_t)width), x = (int)(reps[r - 1] % (uint32_t)width);
+        int yy = (int)(reps[r] / (uint32_t)width), xx = (int)(reps[r] % (uint32_t)width);
+        int start_x = (x < xx) ? x : xx;
+        int end_x = (x > xx) ? x : xx;
+        int start_y = (y < yy) ? y : yy;
+        int end_y = (y > yy) ? y : yy;
+        for (int px = start_x; px <= end_x; px++) MAP_AT(px, y) = TILE_FLOOR;
+        for (int py = start_y; py <= end_y; py++) MAP_AT(xx, py) = TILE_FLOOR;
     }
-    if (map == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return 1; // error
+
+    free(visited);
+    free(queue);
+    free(reps);
+    return 0; // success
+}
+
+// Rows of the summed-area table kept in the ring used by the wall square pass
+#define SAT_ROWS 13
+
+// Builds row r of a summed-area table of floor tiles from row r - 1, in a ring of SAT_ROWS rows.
+// Entry x of row r counts the floors in the rectangle [0, x) x [0, r) of the map.
+static void build_sat_row(const struct catamap *map, uint32_t *sat, size_t stride, int r, int width) {
+    const uint32_t *prev = sat + (size_t)((r - 1) % SAT_ROWS) * stride;
+    uint32_t *row = sat + (size_t)(r % SAT_ROWS) * stride;
+    uint32_t run = 0;
+    row[0] = 0;
+    for (int x = 0; x < width; x++) {
+        run += MAP_AT(x, r - 1) == TILE_FLOOR;
+        row[x + 1] = prev[x + 1] + run;
     }
+}
 
-    // First, fill the map with walls
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            map[y][x] = '1'; // wall
+// map generation
+// The map buffer is allocated on first use and reused by later calls of the same size
+int generate_catacomb_map(struct catamap *map, struct catarng *rng, int width, int height) {
+    // allocate memory for the map, which starts out filled with walls
+    if (map->base != NULL && (map->width != width || map->height != height)) {
+        catamap_close(map);
+    }
+    if (map->base == NULL) {
+        if (catamap_alloc(map, width, height) != 0) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1; // error
         }
+    } else {
+        memset(map->cells, TILE_WALL, (size_t)width * height);
     }
     // Carve out random rooms and corridors
     int min_rooms = (width * height) / (width + height); // minimum of half the map width/height in rooms
-    int num_rooms = random_number_range(min_rooms, min_rooms + 5);
+    int num_rooms = random_number_range(rng, min_rooms, min_rooms + 5);
     // Carve out rooms
     for (int r = 0; r < num_rooms; r++) {
-        int room_width = random_number_range(3, 9);
-        int room_height = random_number_range(3, 9);
-        int room_x = random_number_range(1, width - room_width - 1);
-        int room_y = random_number_range(1, height - room_height - 1);
+        int room_width = random_number_range(rng, 3, 9);
+        int room_height = random_number_range(rng, 3, 9);
+        int room_x = random_number_range(rng, 1, width - room_width - 1);
+        int room_y = random_number_range(rng, 1, height - room_height - 1);
         // before placing the room, check if it overlaps with existing rooms
         int overlap = 0;
         for (int y = room_y - 1; y < room_y + room_height + 1; y++) {
             for (int x = room_x - 1; x < room_x + room_width + 1; x++) {
-                if (map[y][x] == '0') { // already carved out
+                if (MAP_AT(x, y) == TILE_FLOOR) { // already carved out
                     overlap = 1;
                     break;
                 }
@@ -118,38 +184,38 @@ int generate_catacomb_map(int width, int height) {
         // Carve out the room
         for (int y = room_y; y < room_y + room_height; y++) {
             for (int x = room_x; x < room_x + room_width; x++) {
-                map[y][x] = '0'; // floor
+                MAP_AT(x, y) = TILE_FLOOR; // floor
             }
         }
     }
     // Connect rooms with corridors
     // record corridor start and end points
     for (int r = 0; r < num_rooms - 1; r++) {
-        int x1 = random_number_range(1, width - 2);
-        int y1 = random_number_range(1, height - 2);
-        int x2 = random_number_range(1, width - 2);
-        int y2 = random_number_range(1, height - 2);
+        int x1 = random_number_range(rng, 1, width - 2);
+        int y1 = random_number_range(rng, 1, height - 2);
+        int x2 = random_number_range(rng, 1, width - 2);
+        int y2 = random_number_range(rng, 1, height - 2);
 
         // Carve out a simple straight corridor
-        if (random_bool()) {
+        if (random_bool(rng)) {
             for (int x = (x1 < x2 ? x1 : x2); x <= (x1 > x2 ? x1 : x2); x++) {
-                map[y1][x] = '0'; // floor
+                MAP_AT(x, y1) = TILE_FLOOR; // floor
             }
             for (int y = (y1 < y2 ? y1 : y2); y <= (y1 > y2 ? y1 : y2); y++) {
-                map[y][x2] = '0'; // floor
+                MAP_AT(x2, y) = TILE_FLOOR; // floor
             }
         } else {
             for (int y = (y1 < y2 ? y1 : y2); y <= (y1 > y2 ? y1 : y2); y++) {
-                map[y][x1] = '0'; // floor
+                MAP_AT(x1, y) = TILE_FLOOR; // floor
             }
             for (int x = (x1 < x2 ? x1 : x2); x <= (x1 > x2 ? x1 : x2); x++) {
-                map[y2][x] = '0'; // floor
+                MAP_AT(x, y2) = TILE_FLOOR; // floor
             }
         }
         // generate small rooms at corridor ends
         for (int i = 0; i < 2; i++) {
-            int room_width = random_number_range(3, 5);
-            int room_height = random_number_range(3, 5);
+            int room_width = random_number_range(rng, 3, 5);
+            int room_height = random_number_range(rng, 3, 5);
             int room_x = (i == 0) ? x1 - room_width / 2 : x2 - room_width / 2;
             int room_y = (i == 0) ? y1 - room_height / 2 : y2 - room_height / 2;
 
@@ -157,7 +223,7 @@ int generate_catacomb_map(int width, int height) {
             for (int y = room_y; y < room_y + room_height; y++) {
                 for (int x = room_x; x < room_x + room_width; x++) {
                     if (x > 0 && x < width && y > 0 && y < height) {
-                        map[y][x] = '0'; // floor
+                        MAP_AT(x, y) = TILE_FLOOR; // floor
                     }
                 }
             }
@@ -167,13 +233,13 @@ int generate_catacomb_map(int width, int height) {
     // do not overwrite if the position is already a floor, hiding spot, or treasure
     for (int y = 1; y < height - 1; y++) {
         for (int x = 1; x < width - 1; x++) {
-            if (map[y][x] == '0') {
+            if (MAP_AT(x, y) == TILE_FLOOR) {
                 // check if adjacent to a corridor
                 int adjacent_to_corridor = 0;
                 for (int dy = -1; dy <= 1; dy++) {
                     for (int dx = -1; dx <= 1; dx++) {
                         if (abs(dx) + abs(dy) == 1) { // only orthogonal neighbors
-                            if (map[y + dy][x + dx] == '0') {
+                            if (MAP_AT(x + dx, y + dy) == TILE_FLOOR) {
                                 adjacent_to_corridor = 1;
                             }
                         }
@@ -182,9 +248,9 @@ int generate_catacomb_map(int width, int height) {
                 if (!adjacent_to_corridor) {
                     // carve a corridor to the nearest corridor
                     int target_x = x, target_y = y;
-                    while (map[target_y][target_x] != '0') {
+                    while (MAP_AT(target_x, target_y) != TILE_FLOOR) {
                         if (target_x > 1) target_x--;
-                        map[target_y][target_x] = '0';
+                        MAP_AT(target_x, target_y) = TILE_FLOOR;
                     }
                 }
             }
@@ -194,7 +260,7 @@ int generate_catacomb_map(int width, int height) {
      for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
             if (x == 0 || x == width-1 || y == 0 || y == height-1) {
-                map[y][x] = '1'; // wall
+                MAP_AT(x, y) = TILE_WALL; // wall
             }
         }
     }
@@ -204,84 +270,314 @@ int generate_catacomb_map(int width, int height) {
     for (int h = 0; h < num_hiding_spots; h++) {
         int hx, hy;
         do {
-            hx = random_number_range(1, width - 2);
-            hy = random_number_range(1, height - 2);
-        } while (map[hy][hx] != '1');
-        if (map[hy][hx] == '1') { // check for wall tiles
+            hx = random_number_range(rng, 1, width - 2);
+            hy = random_number_range(rng, 1, height - 2);
+        } while (MAP_AT(hx, hy) != TILE_WALL);
+        if (MAP_AT(hx, hy) == TILE_WALL) { // check for wall tiles
             int adjacent_floors = 0;
             int adjacent_hiding_spots = 0;
             // Check orthogonal neighbors only
-            if (hy > 0 && map[hy - 1][hx] == '0') adjacent_floors++;
-            if (hy < height - 1 && map[hy + 1][hx] == '0') adjacent_floors++;
-            if (hx > 0 && map[hy][hx - 1] == '0') adjacent_floors++;
-            if (hx < width - 1 && map[hy][hx + 1] == '0') adjacent_floors++;
+            if (hy > 0 && MAP_AT(hx, hy - 1) == TILE_FLOOR) adjacent_floors++;
+            if (hy < height - 1 && MAP_AT(hx, hy + 1) == TILE_FLOOR) adjacent_floors++;
+            if (hx > 0 && MAP_AT(hx - 1, hy) == TILE_FLOOR) adjacent_floors++;
+            if (hx < width - 1 && MAP_AT(hx + 1, hy) == TILE_FLOOR) adjacent_floors++;
             // check for adjacent hiding spots as well
-            if (hy > 0 && map[hy - 1][hx] == '2') adjacent_hiding_spots++;
-            if (hy < height - 1 && map[hy + 1][hx] == '2') adjacent_hiding_spots++;
-            if (hx > 0 && map[hy][hx - 1] == '2') adjacent_hiding_spots++;
-            if (hx < width - 1 && map[hy][hx + 1] == '2') adjacent_hiding_spots++;
+            if (hy > 0 && MAP_AT(hx, hy - 1) == TILE_HIDING_SPOT) adjacent_hiding_spots++;
+            if (hy < height - 1 && MAP_AT(hx, hy + 1) == TILE_HIDING_SPOT) adjacent_hiding_spots++;
+            if (hx > 0 && MAP_AT(hx - 1, hy) == TILE_HIDING_SPOT) adjacent_hiding_spots++;
+            if (hx < width - 1 && MAP_AT(hx + 1, hy) == TILE_HIDING_SPOT) adjacent_hiding_spots++;
             // place hiding spot if conditions met
-            if (adjacent_floors == 1 && adjacent_hiding_spots == 0 && (rand() % 100) < 20) { // 20% chance
-                map[hy][hx] = '2'; // hiding spot
+            if (adjacent_floors == 1 && adjacent_hiding_spots == 0 && random_number_range(rng, 0, 99) < 20) { // 20% chance
+                MAP_AT(hx, hy) = TILE_HIDING_SPOT; // hiding spot
             }
         }
     }
     // Place small wall squares in large rooms (12x12 entirely floors)
-    for (int y = 0; y <= height - 12; y++) {
-        for (int x = 0; x <= width - 12; x++) {
-            int all_floors = 1;
-            for (int dy = 0; dy < 12; dy++) {
-                for (int dx = 0; dx < 12; dx++) {
-                    if (map[y + dy][x + dx] != '0') {
-                        all_floors = 0;
-                        break;
-                    }
-                }
-                if (!all_floors) break;
+    // Each window is tested in O(1) against a summed-area table of floor tiles. Only the 13 table
+    // rows spanned by the current window row are kept, and the rows below a freshly stamped square
+    // are rebuilt so the following windows see the new walls.
+    if (width >= 12 && height >= 12) {
+        size_t sat_stride = (size_t)width + 1;
+        uint32_t *sat = calloc(SAT_ROWS * sat_stride, sizeof(uint32_t));
+        if (sat == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1; // error
+        }
+        for (int r = 1; r < SAT_ROWS; r++) {
+            build_sat_row(map, sat, sat_stride, r, width);
+        }
+        for (int y = 0; y <= height - 12; y++) {
+            if (y > 0) {
+                build_sat_row(map, sat, sat_stride, y + 12, width);
             }
-            if (all_floors) {
-                // Place a small wall square
-                int wall_size = random_number_range(3, 9);
-                int wall_x = x + random_number_range(0, 18 - wall_size);
-                int wall_y = y + random_number_range(0, 18 - wall_size);
-                for (int wy = wall_y; wy < wall_y + wall_size; wy++) {
-                    for (int wx = wall_x; wx < wall_x + wall_size; wx++) {
-                        map[wy][wx] = '1'; // wall
+            const uint32_t *top = sat + (size_t)(y % SAT_ROWS) * sat_stride;
+            const uint32_t *bottom = sat + (size_t)((y + 12) % SAT_ROWS) * sat_stride;
+            for (int x = 0; x <= width - 12; x++) {
+                uint32_t floors = bottom[x + 12] - bottom[x] - top[x + 12] + top[x];
+                if (floors == 144) {
+                    // Place a small wall square
+                    int wall_size = random_number_range(rng, 3, 9);
+                    int wall_x = x + random_number_range(rng, 0, 18 - wall_size);
+                    int wall_y = y + random_number_range(rng, 0, 18 - wall_size);
+                    // the square can reach past the window, so clip it to the map
+                    for (int wy = wall_y; wy < wall_y + wall_size && wy < height; wy++) {
+                        for (int wx = wall_x; wx < wall_x + wall_size && wx < width; wx++) {
+                            MAP_AT(wx, wy) = TILE_WALL; // wall
+                        }
+                    }
+                    // table rows past wall_y that are already built now count stale floors
+                    for (int r = wall_y + 1; r <= y + 12; r++) {
+                        build_sat_row(map, sat, sat_stride, r, width);
                     }
                 }
             }
         }
+        free(sat);
     }
     // After placing rooms and initial corridors, call the new connection function
-    connect_components(width, height);
+    if (connect_components(map, width, height) != 0) {
+        return 1; // error
+    }
     // Place some random treasures in rooms, avoid placing in corridors by checking for at least 5 surrounding floors in 3x3
     int num_treasures = 3; // fixed number
     for (int t = 0; t < num_treasures; t++) {
         // repeat until a valid spot is found
         int tx, ty;
         do {
-            tx = random_number_range(1, width - 2);
-            ty = random_number_range(1, height - 2);
-        } while (map[ty][tx] != '0' || ({
+            tx = random_number_range(rng, 1, width - 2);
+            ty = random_number_range(rng, 1, height - 2);
+        } while (MAP_AT(tx, ty) != TILE_FLOOR || ({
             int floor_count = 0;
             for (int dy = -1; dy <= 1; dy++) {
                 for (int dx = -1; dx <= 1; dx++) {
-                    if (map[ty + dy][tx + dx] == '0') {
+                    if (MAP_AT(tx + dx, ty + dy) == TILE_FLOOR) {
                         floor_count++;
                     }
                 }
             }
             floor_count < 5;
         }));
-        map[ty][tx] = '3'; // treasure chest
+        MAP_AT(tx, ty) = TILE_TREASURE_CHEST; // treasure chest
     }
     
     return 0; // success
 }
 
+/*
+    Batch generation
+
+    Builds a pool of maps of the same size on a pool of worker threads. Map i of a batch is
+    seeded with batch_map_seed(seed, i), so any single map can be regenerated on its own with
+    --seed. Each worker owns one map buffer that it reuses for every map it builds, and writes
+    its own output files, so workers share nothing but the counter of the next map to build.
+    Files are named <prefix>_<i>.catamap.
+*/
+struct batch_job {
+    int count;
+    int width;
+    int height;
+    const char *prefix;
+    uint64_t seed;
+    int next_map; // next map index to hand out, guarded by lock
+    int failures; // guarded by lock
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+};
+
+// Seed of map i in a batch
+uint64_t batch_map_seed(uint64_t seed, int index) {
+    uint64_t state = seed + (uint64_t)index;
+    return catarng_splitmix64(&state);
+}
+
+static void batch_lock(struct batch_job *job) {
+#ifndef _WIN32
+    pthread_mutex_lock(&job->lock);
+#else
+    (void)job;
+#endif
+}
+
+static void batch_unlock(struct batch_job *job) {
+#ifndef _WIN32
+    pthread_mutex_unlock(&job->lock);
+#else
+    (void)job;
+#endif
+}
+
+static void *batch_worker(void *arg) {
+    struct batch_job *job = arg;
+    struct catamap map = {0}; // this worker's buffer, reused for every map it builds
+    for (;;) {
+        batch_lock(job);
+        int index = job->next_map++;
+        batch_unlock(job);
+        if (index >= job->count) break;
+
+        uint64_t map_seed = batch_map_seed(job->seed, index);
+        struct catarng rng;
+        catarng_seed(&rng, map_seed);
+        char name[280];
+        snprintf(name, sizeof(name), "%s_%d", job->prefix, index);
+        int failed = generate_catacomb_map(&map, &rng, job->width, job->height) != 0 ||
+                     save_map_to_file(&map, name) != 0;
+
+        batch_lock(job);
+        if (failed) {
+            job->failures++;
+        } else {
+            printf("%s.catamap seed %llu\n", name, (unsigned long long)map_seed);
+        }
+        batch_unlock(job);
+    }
+    catamap_close(&map);
+    return NULL;
+}
+
+// Returns 0 if every map was generated and saved, 1 otherwise
+int generate_batch(int count, int width, int height, const char *prefix, uint64_t seed, int threads) {
+    struct batch_job job = {.count = count, .width = width, .height = height, .prefix = prefix, .seed = seed};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#ifndef _WIN32
+    pthread_mutex_init(&job.lock, NULL);
+    if (threads > count) threads = count;
+    pthread_t *workers = malloc((size_t)threads * sizeof(pthread_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, batch_worker, &job) != 0) {
+            fprintf(stderr, "Failed to start worker thread %d\n", started);
+            break;
+        }
+    }
+    if (started == 0) {
+        batch_worker(&job); // no threads could be started, build the batch here
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+#else
+    // No pthreads on Windows, build the batch on this thread
+    threads = 1;
+    batch_worker(&job);
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    int built = count - job.failures;
+    printf("Generated %d of %d maps (%dx%d) in %.3f s on %d threads: %.2f maps/sec\n",
+           built, count, width, height, seconds, threads, seconds > 0 ? built / seconds : 0.0);
+    return job.failures ? 1 : 0;
+}
+
+/*
+    Parses a positive decimal count given on the command line.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static int parse_count(const char *text, int *count) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || value < 1 || value > INT_MAX) {
+        return 1;
+    }
+    *count = (int)value;
+    return 0;
+}
+
+#define BATCH_MIN_SIDE 12
+#define BATCH_MAX_TILES (1L << 26) // 8192x8192, each worker holds a map and its working tables
+
+/*
+    Parses a map size given as WIDTHxHEIGHT on the command line. Both sides must be at least
+    BATCH_MIN_SIDE and the map at most BATCH_MAX_TILES tiles.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static int parse_size(const char *text, int *width, int *height) {
+    char *end;
+    errno = 0;
+    long w = strtol(text, &end, 10);
+    if (end == text || *end != 'x' || errno != 0 || w < BATCH_MIN_SIDE || w > BATCH_MAX_TILES) {
+        return 1;
+    }
+    const char *rest = end + 1;
+    long h = strtol(rest, &end, 10);
+    if (end == rest || *end != '\0' || errno != 0 || h < BATCH_MIN_SIDE || h > BATCH_MAX_TILES / w) {
+        return 1;
+    }
+    *width = (int)w;
+    *height = (int)h;
+    return 0;
+}
+
 // main loop 
-int main() {
-    srand(time(NULL)); // seed random number generator
+// Usage: catacomb_generator [--seed N] [--batch COUNT --size WxH [--prefix NAME] [--threads T]]
+int main(int argc, char *argv[]) {
+    // seed random number generator, maps are reproducible from the printed seed
+    uint64_t seed = (uint64_t)time(NULL);
+    int batch_count = 0;
+    int batch_width = 0, batch_height = 0;
+    const char *batch_prefix = "pool";
+#ifndef _WIN32
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    int threads = 1;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            if (catarng_parse_seed(argv[++i], &seed) != 0) {
+                fprintf(stderr, "Invalid seed: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            if (parse_count(argv[++i], &batch_count) != 0) {
+                fprintf(stderr, "Invalid batch count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &batch_width, &batch_height) != 0) {
+                fprintf(stderr, "Invalid size: %s (expected WIDTHxHEIGHT, at least %dx%d and at most %ld tiles)\n",
+                        argv[i], BATCH_MIN_SIDE, BATCH_MIN_SIDE, BATCH_MAX_TILES);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--prefix") == 0 && i + 1 < argc) {
+            batch_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            if (parse_count(argv[++i], &threads) != 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--seed N] [--batch COUNT --size WxH [--prefix NAME] [--threads T]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (batch_count > 0) {
+        if (batch_width == 0) {
+            fprintf(stderr, "Batch mode needs --size WIDTHxHEIGHT\n");
+            return 1;
+        }
+        if (threads < 1) threads = 1;
+        printf("Seed: %llu\n", (unsigned long long)seed);
+        return generate_batch(batch_count, batch_width, batch_height, batch_prefix, seed, threads);
+    }
+
+    struct catarng rng;
+    catarng_seed(&rng, seed);
 
     int width = 20;
     int height = 10;
@@ -300,71 +596,53 @@ int main() {
     }
 
     // generate the catacomb map
-    if (generate_catacomb_map(width, height) != 0) {
+    struct catamap map = {0};
+    printf("Seed: %llu\n", (unsigned long long)seed);
+    printf("Generating catacomb map of size %dx%d\n", width, height);
+    if (generate_catacomb_map(&map, &rng, width, height) != 0) {
         return 1; // error
     }
 
     // save the map to a file
-    save_map_to_file(filename, width, height);
+    printf("Saving map to %s.catamap\n", filename);
+    if (save_map_to_file(&map, filename) == 0) {
+        print_map_stats(&map);
+    }
 
     // free allocated memory
-    for (int i = 0; i < height; i++) {
-        free(map[i]);
-    }
-    free(map);
+    catamap_close(&map);
 
     return 0; // success
 }
 
 // save map to file
-void save_map_to_file(const char *filename, int width, int height) {
+// Returns 0 on success, 1 on failure
+int save_map_to_file(const struct catamap *map, const char *filename) {
     // save with .catamap extension
-    // add extension if not present
     char full_filename[300];
     snprintf(full_filename, sizeof(full_filename), "%s.catamap", filename);
-    printf("Saving map to %s\n", full_filename);
-    FILE *file = fopen(full_filename, "w");
-    if (file == NULL) {
-        fprintf(stderr, "Failed to open file for writing\n");
-        return;
+    if (catamap_write(full_filename, map) != 0) {
+        fprintf(stderr, "Failed to write %s\n", full_filename);
+        return 1;
     }
-    // write dimensions as header
-    fprintf(file, "%d %d\n", width, height);
-    // print to file
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            fprintf(file, "%c ", map[y][x]);
-        }
-        fprintf(file, "\n");
+    return 0;
+}
+
+// print tile statistics of a generated map
+void print_map_stats(const struct catamap *map) {
+    // count every tile kind in one pass over the grid
+    long tile_counts[4] = {0};
+    size_t tile_total = (size_t)map->width * map->height;
+    for (size_t i = 0; i < tile_total; i++) {
+        tile_counts[map->tiles[i] & 3]++;
     }
+    long wall_count = tile_counts[TILE_WALL];
+    long floor_count = tile_counts[TILE_FLOOR];
     // print out ratio of walls to floors
-    int wall_count = 0;
-    int floor_count = 0;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            if (map[y][x] == '1') wall_count++;
-            if (map[y][x] == '0') floor_count++;
-        }
-    }
-    printf("Wall to floor ratio: %d to %d\n", wall_count, floor_count);
+    printf("Wall to floor ratio: %ld to %ld\n", wall_count, floor_count);
     // print number of hiding spots and treasures
-    int hiding_spot_count = 0;
-    int treasure_count = 0;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            if (map[y][x] == '2') hiding_spot_count++;
-            if (map[y][x] == '3') treasure_count++;
-        }
-    }
-    printf("Hiding spots: %d\n", hiding_spot_count);
-    printf("Treasures: %d of 3\n", treasure_count);
-
-    fclose(file);
-}
-
-int random_number_range(int min, int max) {
-    return rand() % (max - min + 1) + min;
+    long hiding_spot_count = tile_counts[TILE_HIDING_SPOT];
+    long treasure_count = tile_counts[TILE_TREASURE_CHEST];
+    printf("Hiding spots: %ld\n", hiding_spot_count);
+    printf("Treasures: %ld of 3\n", treasure_count);
 }
-int random_bool() {
-    return rand() % 2;
-}
\ No newline at end of file
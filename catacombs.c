@@ -28,7 +28,7 @@
     TURNS:
         The player moves 1 tile per turn, or can skip a turn and do nothing.
         Doing nothing in a turn can be strategic.
-        Checking your heartrate does not cost a turn.
+        Checking your heartrate or redrawing the screen does not cost a turn.
 
     CONTROLS:
         - W: Move North
@@ -37,6 +37,7 @@
         - D: Move East
         - E: Forfeit turn (Do nothing)
         - Q: Check heartrate
+        - R: Redraw the screen
 
         To hide, move into a hiding spot.
         To open a chest and get an item, move into a treasure chest tile.
@@ -87,30 +88,339 @@
 */
 
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
 
-// Game state variables
-int player_x, player_y;
-int player_score; // turns survived + current turn count
-int player_heartrate = 70;
-char player_hidden = 0; // 0 = not hidden, 1 = hidden
-// char* player_map[MAP_HEIGHT][MAP_WIDTH]; // player's revealed map
-// char* entity_map[MAP_HEIGHT][MAP_WIDTH]; // entity positions on map
-char* map_name[100]; // array to hold custom map names
+#include "catamap.h"
+#include "catarng.h"
 
-int map_width;
-int map_height;
+// Floor tiles grouped by FLOOR_BUCKET x FLOOR_BUCKET bucket, for placement (see "Floor index" below)
+struct floor_index {
+    int buckets_x, buckets_y;
+    int width;              // of the map, to turn tile indices back into coordinates
+    uint32_t* tiles;        // tile indices (y * width + x), bucket by bucket
+    uint32_t* bucket_start; // tiles of bucket b are tiles[bucket_start[b] .. bucket_start[b + 1])
+};
 
+// Cluster graph of a map for long trips (see "Hierarchical pathfinding" below)
+#define HPA_CLUSTER 16
+#define HPA_PADDED (HPA_CLUSTER + 2)
 
-int** map_dyn; // 2D array representing the catacombs map, for malloc
-int** entity_positions; // 2D array representing entity & player positions, for malloc
-int* player_map[21][21]; // 21x21 array representing player's revealed map.
+struct hpa_node {
+    int x, y;
+    int first_edge; // edges of the node are edges[first_edge .. next node's first_edge)
+};
 
-int platform_clear_command_supported = 1; // Set to 0 if the platform does not support console clear command
-int should_update_render = 1; // Flag to control rendering updates
+struct hpa_edge {
+    int to;
+    int cost;
+};
+
+struct hpa_graph {
+    int clusters_x, clusters_y;
+    int node_count;
+    struct hpa_node* nodes;    // sorted by cluster, node_count + 1 entries (the last ends the edge list)
+    int* cluster_first_node;   // nodes of cluster c are cluster_first_node[c] .. [c + 1]
+    struct hpa_edge* edges;
+    size_t edge_count;
+};
+
+/*
+    A loaded map. Games only ever read it, so any number of sessions on the same map file can
+    share one (see "Host mode").
+*/
+struct game_map {
+    struct catamap grid; // flat grid of the catacombs map, either a file mapping or one heap block
+    int width, height;
+    uint64_t checksum;   // catamap_checksum of the tiles, ties replays and snapshots to their map
+    char name[256];      // file it was loaded from, the scoreboard, replays and snapshots are named after it
+    struct floor_index floor_index; // built once by floor_index_build, sampled by every session
+    struct hpa_graph hpa_graph;     // built once by hpa_graph_build, searched by every session
+    int users;           // sessions playing on it (host mode)
+};
+#define MAP_AT(map, x, y) CATAMAP_AT(&(map)->grid, (x), (y))
+
+/*
+    Entities, stored as a struct of arrays: entity i is type[i], x[i], y[i], ... All arrays
+    live in one heap block (see entities_alloc), and each simulation phase is one pass over the
+    arrays it needs, so a turn costs time linear in the entity count. Where the entities stand is
+    also kept in an entity_grid, so lookups by place touch only the entities nearby.
+*/
+#define ENTITY_SOUND 0    // Blind (Hearing)
+#define ENTITY_SIGHT 1    // Deaf (Sight)
+#define ENTITY_MOVEMENT 2 // Blind & Deaf (Movement)
+#define ENTITY_TYPES 3
+
+static const char* const entity_names[ENTITY_TYPES] = {
+    [ENTITY_SOUND] = "blind entity",
+    [ENTITY_SIGHT] = "deaf entity",
+    [ENTITY_MOVEMENT] = "blind and deaf entity",
+};
+
+#define ENTITY_IDLE 0        // wandering
+#define ENTITY_INVESTIGATE 1 // heading for a noise at idle speed
+#define ENTITY_AGGRO 2       // chasing the player
+
+// Noise kinds (see "Sound propagation")
+#define NOISE_STEP 0      // the player moved
+#define NOISE_HIDE 1      // the player hid in a closable object
+#define NOISE_HEARTBEAT 2 // the player's heart is racing
+#define NOISE_ENTITY 3    // another entity moved
+#define NOISE_KINDS 4
+
+#define DEFAULT_ENTITY_COUNT 3
+
+// Entities bucketed by ENTITY_GRID_BUCKET x ENTITY_GRID_BUCKET tiles (see "Entity grid" below)
+#define ENTITY_GRID_BUCKET 8
+
+struct entity_grid {
+    int width, height;   // of the map
+    int buckets_x, buckets_y;
+    int* head;   // per bucket, first entity in it or -1
+    int* next;   // per entity, the next and previous entity in its bucket or -1
+    int* prev;
+    int* bucket; // per entity, the bucket it is linked into
+};
+
+// Walks the entities inside a rectangle of tiles (see entity_query_next)
+struct entity_query {
+    int x0, y0, x1, y1;  // tiles, inclusive
+    int bx0, bx1, by1;   // buckets covering them
+    int bx, by;          // bucket being walked
+    int next;            // next entity in it, -1 when the bucket is done
+};
+
+struct entity_set {
+    int count;
+    int* x;
+    int* y;
+    int* target_x; // where the entity is heading when not idle
+    int* target_y;
+    unsigned char* type;
+    unsigned char* state;
+    unsigned char* move_timer; // turns since the entity last moved
+    struct hpa_trip* trip;     // long walk in progress, see hpa_next_step
+    void* block;
+    struct entity_grid grid;   // where they stand, updated through entity_grid_move
+};
+
+
+// Where a sampled tile may be: at least min_dx columns and/or min_dy rows away from (x, y)
+struct spawn_rule {
+    int x, y;
+    int min_dx, min_dy;
+    int both; // 1: far enough on both axes, 0: on either axis
+};
+
+// Shared distance field toward the player for chasing entities (see "Chase field" below)
+#define CHASE_RADIUS 32
+#define CHASE_WINDOW (2 * CHASE_RADIUS + 1)
+#define CHASE_QUEUE (2 * CHASE_RADIUS * (CHASE_RADIUS + 1) + 1) // tiles within the radius
+
+struct chase_field {
+    const struct game_map* map;
+    // distance - bias of the tiles within CHASE_RADIUS columns and rows of the source, or
+    // CHASE_UNREACHED; tile (x, y) is at [y % CHASE_WINDOW][x % CHASE_WINDOW]
+    int32_t stored[CHASE_WINDOW * CHASE_WINDOW];
+    int32_t bias;
+    int source_x, source_y;
+    int valid;       // 0 until the first search
+    int queue[CHASE_QUEUE]; // tile indices of the search frontier
+};
+
+// Path cache and search space for long trips (see "Hierarchical pathfinding" below)
+struct hpa_cache_entry {
+    int32_t from; // tile index, 0 when the slot is empty (tile 0 is a border wall, never on a path)
+    int32_t origin; // where the path was planned from
+    int32_t goal;
+    int32_t next;
+};
+
+// A walk along a planned path: where it was planned from and to, tile indices, 0 when none
+struct hpa_trip {
+    int32_t origin;
+    int32_t goal;
+};
+
+// Search space of path queries, lent to games by whoever plays them (see hpa_scratch_reserve)
+struct hpa_scratch {
+    const struct game_map* map;      // of the query being answered
+    const struct hpa_graph* graph;
+    size_t slots;                    // node scratch allocated, a node count + 1 for the goal
+    size_t heap_capacity;
+    // A* scratch, stamped with the query number instead of cleared
+    int32_t* g;
+    int* parent;
+    uint32_t* seen;
+    uint32_t* closed;
+    uint32_t query;
+    int* heap;
+    int heap_size;
+    // goal tile distance of nodes in the goal cluster, HPA_UNREACHED otherwise
+    int32_t* goal_cost;
+    int* path; // refined tile path of the last search
+    size_t path_length;
+    size_t path_size;
+    // Distances inside one cluster from a tile, HPA_UNREACHED where it cannot walk without leaving
+    int32_t local_dist[HPA_CLUSTER * HPA_CLUSTER];
+    // Walkable tiles of the cluster last searched, with a blocked border so the search needs no bounds checks
+    unsigned char local_open[HPA_PADDED * HPA_PADDED];
+    int local_cluster;
+    // local search scratch
+    int local_queue[HPA_CLUSTER * HPA_CLUSTER];
+    int32_t padded_dist[HPA_PADDED * HPA_PADDED];
+};
+
+// A game's long trips: its own small cache of planned steps, searched with borrowed scratch
+struct hpa_planner {
+    const struct game_map* map;
+    struct hpa_scratch* scratch;
+    struct hpa_cache_entry* cache;
+    size_t cache_mask;
+};
+
+#define GAME_MESSAGES_SIZE 512
+// The player sees up to VIEW_RADIUS tiles away, inside a VIEW_SIZE x VIEW_SIZE window around them
+#define VIEW_RADIUS 10
+#define VIEW_SIZE (2 * VIEW_RADIUS + 1)
+
+// The view window as bitmasks, one row word per tile kind. Bit x of row y is column x of the window.
+#if VIEW_SIZE > 64
+#error "VIEW_SIZE must fit in a 64-bit row mask"
+#endif
+typedef uint64_t view_row;
+#define VIEW_ROW_MASK ((view_row)-1 >> (64 - VIEW_SIZE))
+struct view_window {
+    view_row wall[VIEW_SIZE];
+    view_row floor[VIEW_SIZE];
+    view_row hiding[VIEW_SIZE];
+    view_row chest[VIEW_SIZE];
+    // Cells that stop a line of sight, per quadrant of the line's direction (see build_view_blockers)
+    view_row blocks[4][VIEW_SIZE];
+};
+
+#define PROFILE_INPUT 0
+#define PROFILE_MOVE 1
+#define PROFILE_ENTITIES 2
+#define PROFILE_LOS 3
+#define PROFILE_RENDER 4
+#define PROFILE_PHASES 5
+// Scoped phase timer: uint64_t started = PROFILE_START(game); ... PROFILE_STOP(game, PROFILE_MOVE, started);
+#define PROFILE_START(game) ((game)->profile != NULL ? clock_ns() : 0)
+#define PROFILE_STOP(game, phase, started) do { if ((game)->profile != NULL) profile_record((game), (phase), clock_ns() - (started)); } while (0)
+// Bot policies for --headless
+#define BOT_RANDOM 0
+#define BOT_HIDE 1
+#define BOT_INPUT 2
+
+/*
+    A game session: everything one game changes as it is played. Every game function works on
+    the session it is given, so a process can run any number of games side by side (see
+    "Host mode"); all they share is their map, which they only read, tables filled once at
+    startup, and the path search scratch of the thread playing them.
+*/
+struct game_session {
+    const struct game_map* map;
+    uint64_t seed;           // kept in replays and snapshots
+    struct catarng rng;      // every random decision of the game, seeded from seed
+    int player_x, player_y;
+    int player_score;        // turns survived + current turn count
+    int player_heartrate;
+    char player_hidden;      // 0 = not hidden, 1 = hidden
+    int player_moved;        // 1 if the player moved this turn (makes noise, can be sensed)
+    int player_still_turns;  // turns in a row the player stood still
+    struct entity_set entities;
+    struct chase_field chase_field;
+    struct hpa_planner hpa;
+    struct noise* noises;    // pool of SOUND_POOL_SIZE (see "Sound propagation")
+    int noise_count;
+    char messages[GAME_MESSAGES_SIZE]; // lines shown under the map on the next frame, cleared every turn
+
+    FILE* out;               // where frames, prompts and messages go
+    int should_update_render; // Flag to control rendering updates
+    int headless;            // 1 while a bot plays or a replay runs, without any output
+    char frame_cells[VIEW_SIZE][VIEW_SIZE]; // symbols of the last frame drawn
+    int frame_width, frame_height; // size of the last frame drawn, 0 when a full redraw is due
+
+    FILE* replay_out;        // replay being recorded, NULL if none (see "Replays")
+    int replay_run_key;      // key code of the run not written yet, -1 if none
+    uint64_t replay_run_length;
+    const char* snapshot_path; // where P saves the game (see "Snapshots"), NULL if it cannot
+    int suspended;           // 1 once the game was saved with P, it then ends without a score
+    int idle_turn_ms;        // --tick: waiting this long for a key skips the turn, 0 waits forever
+    struct profile_histogram* profile; // PROFILE_PHASES histograms with --profile, NULL otherwise
+};
+
+// One finished game on a map's scoreboard (see "Scoreboard")
+#define SCORE_TOP_K 100 // best scores kept in order at the start of the file
+
+struct score_record {
+    int64_t timestamp; // when the game ended, seconds since the epoch (0 if unknown)
+    uint64_t seed;
+    int32_t score;
+    uint32_t entities;
+};
+
+// Start of a scoreboard file
+struct score_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t record_count;
+    uint32_t top_count;
+    uint32_t top_capacity;
+};
+
+// Start of a snapshot file, decoded (see "Snapshots" for how it is stored)
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t seed;
+    uint64_t map_checksum;
+    uint32_t map_width;
+    uint32_t map_height;
+    uint32_t entity_count;
+    uint32_t noise_count;
+    uint64_t rng[4];
+    int32_t player_x;
+    int32_t player_y;
+    int32_t player_score;
+    int32_t player_heartrate;
+    int32_t player_still_turns;
+    uint8_t player_hidden;
+    uint8_t player_moved;
+    uint8_t reserved[2];
+};
+
+// Start of a replay file (see "Replays")
+struct replay_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t seed;
+    uint64_t map_checksum;
+    uint32_t map_width;
+    uint32_t map_height;
+    uint32_t entity_count;
+    uint32_t reserved;
+};
 
 /*
     Map layout key:
@@ -119,33 +429,97 @@ int should_update_render = 1; // Flag to control rendering updates
         2 = Hiding Spot
         3 = Treasure Chest
 
-    Entity types (placements are random):
+    Entity types (placements are random, types cycle through the list):
         0 = Blind (Hearing)
         1 = Deaf (Sight)
         2 = Blind & Deaf (Movement)
 */
 
 /* Function prototypes */
-int initialize_game();
+int initialize_game(struct game_session* game, const struct game_map* map, struct hpa_scratch* scratch, uint64_t seed, int entity_count);
 // game logic updates
-void update_player_bpm(int flag);
-int update_player_position(int dx, int dy);
-int update_game();
+void update_player_bpm(struct game_session* game, int flag);
+int tile_walkable(const struct game_map* map, int x, int y);
+int update_player_position(struct game_session* game, int dx, int dy);
+int update_game(struct game_session* game);
+void show_prompt(struct game_session* game);
+int play_turn(struct game_session* game, int key);
+int place_actors(struct game_session* game);
+uint64_t clock_ns();
+void profile_record(struct game_session* game, int phase, uint64_t ns);
+int profile_enable(struct game_session* game);
+int profile_dump(const struct game_session* game);
+void map_sibling_path(const struct game_map* map, char* path, size_t size, const char* extension);
+int run_headless(struct game_session* game, long long turns, int policy, const char* input_path, long long check_turn);
+int run_host(const char* socket_path, struct game_map* default_map, int workers, int entity_count, uint64_t seed);
+int replay_record_start(struct game_session* game, const char* filename);
+void replay_record(struct game_session* game, char key);
+void replay_record_stop(struct game_session* game);
+FILE* replay_open(const char* filename, struct replay_header* header);
+int run_replay(struct game_session* game, FILE* file, const struct replay_header* header, int step);
+int update_idle(struct game_session* game, uint64_t waited_ms);
+int step_entities(struct game_session* game);
+int entities_alloc(struct entity_set* set, int count, const struct game_map* map);
+void entities_free(struct entity_set* set);
+void entity_grid_rebuild(struct entity_set* set);
+void entity_grid_move(struct entity_set* set, int i);
+int entity_at(const struct entity_set* set, int x, int y);
+void entity_query_begin(struct entity_query* query, const struct entity_set* set, int x0, int y0, int x1, int y1);
+int entity_query_next(struct entity_query* query, const struct entity_set* set);
+void post_message(struct game_session* game, const char* message);
+void post_notice(struct game_session* game, const char* message);
+int noises_alloc(struct game_session* game);
+int emit_noise(struct game_session* game, int x, int y, int kind, int source);
+void clear_noises(struct game_session* game);
+int hpa_graph_build(struct game_map* map);
+void hpa_graph_free(struct hpa_graph* graph);
+int hpa_scratch_reserve(struct hpa_scratch* scratch, const struct hpa_graph* graph);
+void hpa_scratch_free(struct hpa_scratch* scratch);
+int hpa_planner_init(struct hpa_planner* hpa, const struct game_map* map, struct hpa_scratch* scratch, int entity_count);
+void hpa_planner_free(struct hpa_planner* hpa);
+int hpa_next_step(struct hpa_planner* hpa, struct hpa_trip* trip, int fx, int fy, int tx, int ty, int* next_x, int* next_y);
+int floor_index_build(struct game_map* map);
+void floor_index_free(struct floor_index* index);
+int sample_floor_tile(const struct floor_index* index, struct catarng* rng, const struct spawn_rule* rule, int* x, int* y);
+void chase_field_init(struct chase_field* field, const struct game_map* map);
+void chase_field_update(struct chase_field* field, int x, int y);
+int chase_field_step(const struct chase_field* field, int* x, int* y);
+// keyboard input
+int input_init();
+void input_restore();
+int read_key(int timeout_ms);
 // game rendering and cleanup
-void render_game();
-void cleanup_game();
-int load_map_from_file(const char* filename);
-void save_scoreboard(const char* map_name, int score);
-void line_of_sight(int map[21][21], int visibility[21][21], int origin_x, int origin_y);
-int is_line_of_sight(int map[21][21], int x1, int y1, int x2, int y2);
-// Utility functions
-int random_number_range(int min, int max);
-int random_bool();
+int render_game(struct game_session* game);
+void request_full_redraw(struct game_session* game);
+int frame_is_stale();
+void cleanup_game(struct game_session* game);
+void free_game(struct game_session* game);
+int load_map_from_file(struct game_map* map, const char* filename);
+int read_map(struct game_map* map, FILE* file, const char* filename);
+void close_map(struct game_map* map);
+int save_scoreboard(struct game_session* game);
+int print_scoreboard(const struct game_map* map, FILE* out, int count);
+int snapshot_save(const struct game_session* game, const char* filename);
+FILE* snapshot_open(const char* filename, struct snapshot_header* header);
+int snapshot_check_map(const struct game_map* map, const struct snapshot_header* header);
+int snapshot_restore(struct game_session* game, FILE* file, const struct snapshot_header* header);
+struct game_session* snapshot_fork(const struct game_session* game);
+int snapshot_matches(const struct game_session* a, const struct game_session* b);
+void view_origin(const struct game_map* map, int center_x, int center_y, int* start_x, int* start_y);
+void build_view_window(const struct game_map* map, struct view_window* view, int start_x, int start_y);
+void build_view_blockers(struct view_window* view);
+int line_of_sight(const struct view_window* view, view_row visibility[VIEW_SIZE], int origin_x, int origin_y);
+void init_ray_tables();
+int is_line_of_sight(const struct view_window* view, int x1, int y1, int x2, int y2);
+int field_of_view(const struct view_window* view, int origin_x, int origin_y, int radius, view_row los[VIEW_SIZE]);
 
 /*
     Map file reading and detection
 
-    For custom maps, the game will read from a text file formatted as follows:
+    Maps made by the map generator use the binary format described in catamap.h. They are
+    mapped straight into memory and the tiles are used in place without any parsing.
+
+    Older custom maps may still use the text format, formatted as follows:
     - The first line contains two integers separated by a space, representing the width and height of the map.
     - The subsequent lines contain the map layout, with each tile represented by an integer value (0-3) separated by spaces.
     - Example:
@@ -154,14 +528,16 @@ int random_bool();
         1 0 0 0 2 0 0 0 3 1
         1 0 1 1 1 1 0 1 0 1
         ...
-    The game will parse this file to create the internal representation of the map.
+    The format is detected from the first bytes of the file, both load through this function.
     The file name can be specified as a command-line argument; if none is provided, a default map will be used.
 
     Scoreboards will be made for custom maps, identified by the map file name.
 
     File extensions:
         - Map files should use the ".catamap" extension.
-        - Scoreboard files should use the ".catascore" extension.
+        - Scoreboard files should use the ".catascore" extension (see "Scoreboard").
+        - Replay files use the ".catareplay" extension (see "Replays").
+        - Snapshot files use the ".catasave" extension (see "Snapshots").
 
     Note: Error handling for file reading and parsing is essential to ensure robustness.
     If the map file is invalid or cannot be read, the game should gracefully fall back to a default map.
@@ -171,10 +547,10 @@ int random_bool();
         1 on failure
 */ 
 
-int load_map_from_file(const char* filename) {
+int load_map_from_file(struct game_map* map, const char* filename) {
     // Implementation for loading map from file goes here
     printf("Loading map from file: %s\n", filename);
-    FILE* file = fopen(filename, "r");
+    FILE* file = fopen(filename, "rb");
     if (!file) {
         perror("Error opening map file");
         // Ask the user if they would like to play the default map instead
@@ -182,30 +558,61 @@ int load_map_from_file(const char* filename) {
         printf("Would you like to play the default map instead? (y/n): ");
         scanf(" %c", &choice);
         if (choice == 'y' || choice == 'Y') {
-            load_map_from_file("default.catamap");
+            return load_map_from_file(map, "default.catamap");
         } // else exit the game
         else {
             return 1;
         }
     }
+    return read_map(map, file, filename);
+}
+
+/*
+    Reads a map in either format from a file opened on filename, without asking anything, and
+    closes the file. Used by load_map_from_file, and by host mode for the maps clients ask for.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int read_map(struct game_map* map, FILE* file, const char* filename) {
+    memset(map, 0, sizeof(*map));
+    // Set map name for scoreboard purposes
+    snprintf(map->name, sizeof(map->name), "%s", filename);
+
+    // Binary maps are mapped into memory and used in place
+    char magic[sizeof(((struct catamap_header*)0)->magic)];
+    size_t magic_length = fread(magic, 1, sizeof(magic), file);
+    if (catamap_is_binary(magic, magic_length)) {
+        fclose(file);
+        if (catamap_open(filename, &map->grid) != 0) {
+            return 1;
+        }
+        map->width = map->grid.width;
+        map->height = map->grid.height;
+        // already validated against the tiles by catamap_open
+        struct catamap_header header;
+        catamap_header_decode((const unsigned char*)map->grid.base, &header);
+        map->checksum = header.checksum;
+        printf("Map dimensions: %dx%d\n", map->width, map->height);
+        return 0; // success
+    }
+    rewind(file);
 
     // Read map dimensions
     int width = 0, height = 0;
-    fscanf(file, "%d %d", &width, &height);
+    if (fscanf(file, "%d %d", &width, &height) != 2 || width <= 0 || height <= 0) {
+        fprintf(stderr, "Invalid map file %s: bad dimensions\n", filename);
+        fclose(file);
+        return 1;
+    }
     printf("Map dimensions: %dx%d\n", width, height);
-    map_width = width;
-    map_height = height;
-    // Set map name for scoreboard purposes
-    snprintf((char*)map_name, sizeof(map_name), "%s", filename);
+    map->width = width;
+    map->height = height;
     
-    // Allocate memory for the map
-    map_dyn = malloc(height * sizeof(int*));
-    for (int i = 0; i < height; i++) {
-        map_dyn[i] = malloc(width * sizeof(int));
-    }
-
+    // Allocate memory for the map as one block
     // check if malloc succeeded
-    if (map_dyn == NULL) {
+    if (catamap_alloc(&map->grid, width, height) != 0) {
         perror("Error allocating memory for map");
         fclose(file);
         return 1;
@@ -214,7 +621,9 @@ int load_map_from_file(const char* filename) {
     // Populate the map array
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
-            fscanf(file, "%d", &map_dyn[y][x]);
+            int tile = TILE_WALL;
+            fscanf(file, "%d", &tile);
+            CATAMAP_CELL(&map->grid, x, y) = (unsigned char)tile;
         }
     }
 
@@ -222,23 +631,155 @@ int load_map_from_file(const char* filename) {
     // printf("Loaded Map:\n");
     // for (int y = 0; y < height; y++) {
     //     for (int x = 0; x < width; x++) {
-    //         printf("%d ", map_dyn[y][x]);
+    //         printf("%d ", MAP_AT(map, x, y));
     //     }
     //     printf("\n");
     // }
 
     fclose(file);
+    map->checksum = catamap_checksum(map->grid.tiles, (size_t)width * (size_t)height);
     return 0; // success
 }
 
+// Unmaps or frees the map and its floor index
+void close_map(struct game_map* map) {
+    catamap_close(&map->grid);
+    floor_index_free(&map->floor_index);
+    hpa_graph_free(&map->hpa_graph);
+}
+
 
 
 
 // Main game loop, takes care of initialization, updating, rendering, and cleanup
+// Usage: catacombs [--seed N] [--entities N] [--headless TURNS [--bot random|hide|FILE] [--check-resume TURN]] [--record FILE] [--replay FILE [--step]] [--resume FILE] [--tick MS] [--profile] [--scores] [--host SOCKET [--workers N]] [map file]
 int main(int argc, char* argv[]) {
+    const char* map_arg = NULL;
+    int entity_count = DEFAULT_ENTITY_COUNT;
+    long long headless_turns = 0; // from --headless, 0 to play normally
+    int bot_policy = BOT_RANDOM;
+    const char* bot_input = NULL;
+    const char* record_path = NULL; // --record, or <map name>-<seed>-<time>.catareplay
+    const char* replay_path = NULL;
+    int replay_step = 0;
+    const char* resume_path = NULL; // --resume: snapshot to continue from
+    long long check_turn = 0; // --check-resume: turn of a headless run to save and resume at
+    int profile_enabled = 0;
+    int show_scores = 0; // --scores: print the map's best scores and exit
+    const char* host_path = NULL; // --host: serve games on this socket instead of playing one
+    int host_workers = 0; // --workers, 0 for one per processor
+    int idle_turn_ms = 0; // --tick, 0 to wait for every key
+    uint64_t seed = (uint64_t)time(NULL);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            if (catarng_parse_seed(argv[++i], &seed) != 0) {
+                fprintf(stderr, "Invalid seed: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--entities") == 0 && i + 1 < argc) {
+            entity_count = atoi(argv[++i]);
+            if (entity_count < 0) {
+                fprintf(stderr, "Invalid entity count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+            headless_turns = atoll(argv[++i]);
+            if (headless_turns <= 0) {
+                fprintf(stderr, "Invalid turn count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bot") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "random") == 0) {
+                bot_policy = BOT_RANDOM;
+            } else if (strcmp(argv[i], "hide") == 0) {
+                bot_policy = BOT_HIDE;
+            } else {
+                bot_policy = BOT_INPUT; // anything else names a file of keys
+                bot_input = argv[i];
+            }
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+            resume_path = argv[++i];
+        } else if (strcmp(argv[i], "--check-resume") == 0 && i + 1 < argc) {
+            check_turn = atoll(argv[++i]);
+            if (check_turn <= 0) {
+                fprintf(stderr, "Invalid turn: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--step") == 0) {
+            replay_step = 1;
+        } else if (strcmp(argv[i], "--tick") == 0 && i + 1 < argc) {
+            idle_turn_ms = atoi(argv[++i]);
+            if (idle_turn_ms <= 0) {
+                fprintf(stderr, "Invalid tick: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile_enabled = 1;
+        } else if (strcmp(argv[i], "--scores") == 0) {
+            show_scores = 1;
+        } else if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host_path = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            host_workers = atoi(argv[++i]);
+            if (host_workers <= 0) {
+                fprintf(stderr, "Invalid worker count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (map_arg == NULL) {
+            map_arg = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--seed N] [--entities N] [--headless TURNS [--bot random|hide|FILE] [--check-resume TURN]] [--record FILE] [--replay FILE [--step]] [--resume FILE] [--tick MS] [--profile] [--scores] [--host SOCKET [--workers N]] [map file]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (host_path != NULL && (headless_turns > 0 || record_path != NULL || replay_path != NULL ||
+                              resume_path != NULL || idle_turn_ms > 0 || profile_enabled || show_scores)) {
+        fprintf(stderr, "--host cannot be combined with --headless, --record, --replay, --resume, --tick, --profile or --scores\n");
+        return 1;
+    }
+
+    if (check_turn > 0 && (headless_turns == 0 || check_turn >= headless_turns)) {
+        fprintf(stderr, "--check-resume needs --headless with more turns than the check turn\n");
+        return 1;
+    }
+
+    // A replay brings its own seed and entity count
+    struct replay_header replay;
+    FILE* replay_file = NULL;
+    if (replay_path != NULL) {
+        replay_file = replay_open(replay_path, &replay);
+        if (replay_file == NULL) {
+            return 1;
+        }
+        seed = replay.seed;
+        entity_count = (int)replay.entity_count;
+    }
+
+    // So does a snapshot, the rest of its state is restored once the game is set up
+    struct snapshot_header snapshot;
+    FILE* snapshot_file = NULL;
+    if (resume_path != NULL) {
+        if (replay_file != NULL) {
+            fprintf(stderr, "--resume cannot be combined with --replay\n");
+            return 1;
+        }
+        snapshot_file = snapshot_open(resume_path, &snapshot);
+        if (snapshot_file == NULL) {
+            return 1;
+        }
+        seed = snapshot.seed;
+        entity_count = (int)snapshot.entity_count;
+    }
+
+    struct game_map map;
     int map_load_status;
-    if (argc > 1) {
-        map_load_status = load_map_from_file(argv[1]);
+    if (map_arg != NULL) {
+        map_load_status = load_map_from_file(&map, map_arg);
     } else {
         // Check if default map exists
         FILE* default_file = fopen("default.catamap", "r");
@@ -250,450 +791,4576 @@ int main(int argc, char* argv[]) {
             printf("Please create a default map by compiling and running the map generator: catacomb_generator.c\n");
         }
         // Load default map
-        map_load_status = load_map_from_file("default.catamap");
+        map_load_status = load_map_from_file(&map, "default.catamap");
     }
 
     if (map_load_status != 0) {
         printf("Failed to load a valid map. Exiting game.\n");
         return 1;
     }
+    if (show_scores) {
+        int status = print_scoreboard(&map, stdout, SCORE_TOP_K);
+        close_map(&map);
+        return status;
+    }
+
+    // Index the floor tiles once, every placement samples from it
+    if (floor_index_build(&map) != 0) {
+        perror("Error allocating memory for the floor index");
+        close_map(&map);
+        return 1;
+    }
+    // and the cluster graph, every long trip is planned on it
+    if (hpa_graph_build(&map) != 0) {
+        perror("Error building the pathfinding graph");
+        close_map(&map);
+        return 1;
+    }
+
+    if (host_path != NULL) {
+        int status = run_host(host_path, &map, host_workers, entity_count, seed);
+        close_map(&map);
+        return status;
+    }
+
+    if (snapshot_file != NULL && snapshot_check_map(&map, &snapshot) != 0) {
+        fclose(snapshot_file);
+        close_map(&map);
+        return 1;
+    }
 
-    if (initialize_game() != 0) {
+    struct hpa_scratch scratch; // path searches of the game
+    memset(&scratch, 0, sizeof(scratch));
+    struct game_session game;
+    if (initialize_game(&game, &map, &scratch, seed, entity_count) != 0) {
         printf("Failed to initialize game. Exiting.\n");
         return 1;
     }
 
+    // Print initial positions for verification
+    printf("Seed: %llu\n", (unsigned long long)seed);
+    printf("Player starting position: (%d, %d)\n", game.player_x, game.player_y);
+    for (int i = 0; i < game.entities.count && i < 10; i++) {
+        printf("Entity %d starting position: (%d, %d)\n", i, game.entities.x[i], game.entities.y[i]);
+    }
+    if (game.entities.count > 10) {
+        printf("... and %d more entities\n", game.entities.count - 10);
+    }
+
+    if (profile_enabled && profile_enable(&game) != 0) {
+        perror("Error allocating memory for the profile");
+        cleanup_game(&game);
+        hpa_scratch_free(&scratch);
+        close_map(&map);
+        return 1;
+    }
+    if (snapshot_file != NULL) {
+        int status = snapshot_restore(&game, snapshot_file, &snapshot);
+        fclose(snapshot_file);
+        if (status != 0) {
+            cleanup_game(&game);
+            hpa_scratch_free(&scratch);
+            close_map(&map);
+            return 1;
+        }
+    }
+    if (replay_file != NULL) {
+        int status = run_replay(&game, replay_file, &replay, replay_step);
+        fclose(replay_file);
+        cleanup_game(&game);
+        hpa_scratch_free(&scratch);
+        close_map(&map);
+        return status;
+    }
+    // Replays start from a new game, so resumed sessions are not recorded. Headless runs
+    // are only recorded when asked to.
+    if (headless_turns > 0 && record_path != NULL && resume_path == NULL && replay_record_start(&game, record_path) != 0) {
+        perror("Error creating replay file, the run will not be recorded");
+    }
+    if (headless_turns > 0) {
+        int status = run_headless(&game, headless_turns, bot_policy, bot_input, check_turn);
+        cleanup_game(&game);
+        hpa_scratch_free(&scratch);
+        close_map(&map);
+        return status;
+    }
+    if (input_init() != 0) {
+        printf("Failed to set up keyboard input. Exiting.\n");
+        return 1;
+    }
+
+    // Record the session so it can be played back with --replay. Replays start from a new
+    // game, so resumed sessions are not recorded. Each session gets its own file by default.
+    char default_record[256];
+    if (record_path == NULL) {
+        char extension[64];
+        snprintf(extension, sizeof(extension), "-%llu-%lld.catareplay", (unsigned long long)seed, (long long)time(NULL));
+        map_sibling_path(&map, default_record, sizeof(default_record), extension);
+        record_path = default_record;
+    }
+    if (resume_path == NULL && replay_record_start(&game, record_path) != 0) {
+        perror("Error creating replay file, the game will not be recorded");
+    }
+
+    // P saves over the snapshot the game was resumed from, or next to the map
+    char default_snapshot[256];
+    if (resume_path != NULL) {
+        game.snapshot_path = resume_path;
+    } else {
+        map_sibling_path(&map, default_snapshot, sizeof(default_snapshot), ".catasave");
+        game.snapshot_path = default_snapshot;
+    }
+
+    game.idle_turn_ms = idle_turn_ms;
     int gameState = 1; // 1 = running, 0 = game over
 
-    render_game();
+    render_game(&game);
 
     while (gameState) {
-        gameState = update_game();
-        if (should_update_render==1) {
-            render_game();
+        gameState = update_game(&game);
+        if (game.should_update_render==1) {
+            render_game(&game);
         }
     }
 
-    save_scoreboard((const char*)map_name, player_score);
+    // A suspended game is not over yet, it is scored when it ends
+    if (!game.suspended) {
+        save_scoreboard(&game);
+    }
+    if (game.replay_out != NULL) {
+        printf("The game was recorded to %s. Watch it with --replay %s\n", record_path, record_path);
+    }
 
-    cleanup_game();
+    cleanup_game(&game);
+    hpa_scratch_free(&scratch);
+    close_map(&map);
     return 0;
 }
 
 
-int initialize_game() {
-    // Initialize player position, health, score, and other game state variables
-    player_score = 0; // Start on turn 0
-
-    // Get current operating system for console clear command
-    #ifdef _WIN32
-        platform_clear_command_supported = 1; // Windows supports "cls"
-    #else
-        platform_clear_command_supported = 0; // Other platforms may not support clear command
-    #endif
-
-
-    // Player placements
-    // attempt to randomly place the player on a floor tile
-    srand((unsigned int)time(NULL)); // Seed the random number generator
-    do {
-        player_x = random_number_range(1, map_width - 2); // avoid placing on border walls
-        player_y = random_number_range(1, map_height - 2);
-    } while (map_dyn[player_y][player_x] != 0); // repeat until a floor tile is found
+/*
+    Sets up a new game on a loaded map whose floor index and cluster graph are built: its own
+    random generator, entities, pathfinding structures, and the player and entities placed for
+    the first round. Path searches run in the given scratch, which the game only uses while one
+    of its turns is played, so games taking turns on one thread can share one. The game draws
+    to stdout until its out stream is changed.
 
+    Returns:
+        0 on success
+        1 on failure
+*/
+int initialize_game(struct game_session* game, const struct game_map* map, struct hpa_scratch* scratch, uint64_t seed, int entity_count) {
+    memset(game, 0, sizeof(*game));
+    game->map = map;
+    game->out = stdout;
+    game->should_update_render = 1;
+    game->replay_run_key = -1;
+    game->player_heartrate = 70;
+    // Every random decision in the session comes from this seed
+    game->seed = seed;
+    catarng_seed(&game->rng, seed);
+    init_ray_tables();
 
     // Entity placements
-    // Place entities at least 1/4th the map size away from the player
-    // attempt to place them on floor tiles
-    entity_positions = malloc(3 * sizeof(int*)); // 3 entities
-    // check if malloc succeeded
-    if (entity_positions == NULL) {
-        perror("Error allocating memory for entity positions");
+    if (entities_alloc(&game->entities, entity_count, map) != 0) {
+        perror("Error allocating memory for entities");
+        free_game(game);
+        return 1; // failure
+    }
+    chase_field_init(&game->chase_field, map);
+    if (noises_alloc(game) != 0) {
+        perror("Error allocating memory for noises");
+        free_game(game);
+        return 1; // failure
+    }
+    if (hpa_planner_init(&game->hpa, map, scratch, entity_count) != 0) {
+        perror("Error allocating memory for pathfinding");
+        free_game(game);
         return 1; // failure
     }
 
-    for (int i = 0; i < 3; i++) {
-        entity_positions[i] = malloc(2 * sizeof(int)); // x and y positions
-        int ex, ey;
-        do {
-            ex = random_number_range(1, map_width - 2);
-            ey = random_number_range(1, map_height - 2);
-        } while (map_dyn[ey][ex] != 0 || // must be on floor tile
-                 abs(ex - player_x) < map_width / 4 || // must be at least 1/4th map width away
-                 abs(ey - player_y) < map_height / 4); // must be at least 1/4th map height away
-        entity_positions[i][0] = ex;
-        entity_positions[i][1] = ey;
+    if (place_actors(game) != 0) {
+        free_game(game);
+        return 1; // failure
     }
 
     // Verify player placement is on a floor tile
-    if (map_dyn[player_y][player_x] != 0) {
+    if (MAP_AT(map, game->player_x, game->player_y) != 0) {
         printf("Error: Player not placed on a floor tile!\n");
+        free_game(game);
         return 1; // failure
     }
 
-    // Print initial positions for verification
-    printf("Player starting position: (%d, %d)\n", player_x, player_y);
-    for (int i = 0; i < 3; i++) {
-        printf("Entity %d starting position: (%d, %d)\n", i, entity_positions[i][0], entity_positions[i][1]);
+    return 0; // success
+}
+
+/*
+    Places the player and the entities for a fresh round, on the map and structures set up by
+    initialize_game. Also used by the headless simulation to start over after a capture.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int place_actors(struct game_session* game) {
+    const struct game_map* map = game->map;
+    struct entity_set* entities = &game->entities;
+    game->player_score = 0;
+    game->player_heartrate = 70;
+    game->player_moved = 0;
+    game->player_still_turns = 0;
+    game->messages[0] = '\0';
+    clear_noises(game);
+
+    // Player placements
+    // place the player on a random floor tile, border walls excluded
+    if (sample_floor_tile(&map->floor_index, &game->rng, NULL, &game->player_x, &game->player_y) != 0) {
+        printf("Error: the map has no floor tile to place the player on!\n");
+        return 1; // failure
     }
 
+    // Place entities on floor tiles at least 1/4th the map width and height away from the player
+    struct spawn_rule far_from_player = {game->player_x, game->player_y, map->width / 4, map->height / 4, 1};
+    for (int i = 0; i < entities->count; i++) {
+        if (sample_floor_tile(&map->floor_index, &game->rng, &far_from_player, &entities->x[i], &entities->y[i]) != 0) {
+            printf("Error: no floor tile is far enough from the player to place entities on!\n");
+            return 1; // failure
+        }
+        entities->type[i] = (unsigned char)(i % ENTITY_TYPES);
+        entities->state[i] = ENTITY_IDLE;
+        entities->move_timer[i] = 0;
+        entities->target_x[i] = entities->x[i];
+        entities->target_y[i] = entities->y[i];
+        entities->trip[i] = (struct hpa_trip){0, 0};
+    }
+    entity_grid_rebuild(entities);
     return 0; // success
 }
 
-void update_player_bpm(int flag) {
+void update_player_bpm(struct game_session* game, int flag) {
     if (flag == 1) { // moving
-        player_heartrate += 1;
-        if (player_heartrate > 100) {
-            player_heartrate = 100; // cap at 100 BPM
+        game->player_heartrate += 1;
+        if (game->player_heartrate > 100) {
+            game->player_heartrate = 100; // cap at 100 BPM
         }
     } else if (flag == 0) { // doing nothing
-        player_heartrate -= 2;
-        if (player_heartrate < 70) {
-            player_heartrate = 70; // floor at 70 BPM
+        game->player_heartrate -= 2;
+        if (game->player_heartrate < 70) {
+            game->player_heartrate = 70; // floor at 70 BPM
         }
     }
 }
 
+// 1 if the player (or anything chasing them) can step onto (x, y): in bounds, below the top row, not a wall
+int tile_walkable(const struct game_map* map, int x, int y) {
+    return x >= 0 && x < map->width && y > 0 && y < map->height && MAP_AT(map, x, y) != TILE_WALL;
+}
+
 // returns 1 if move was valid and executed, 0 otherwise
-int update_player_position(int dx, int dy) {
+int update_player_position(struct game_session* game, int dx, int dy) {
+    uint64_t started = PROFILE_START(game);
+    int moved = 0;
     // check if movement would run into walls or out of bounds
-    if (player_x + dx < 0 || player_x + dx >= map_width || player_y + dy < 0 || player_y + dy >= map_height) {
-        return 0; // invalid move, do nothing
+    if (tile_walkable(game->map, game->player_x + dx, game->player_y + dy)) {
+        update_player_bpm(game, 1);
+        game->player_x += dx;
+        game->player_y += dy;
+        moved = 1;
+    }
+    PROFILE_STOP(game, PROFILE_MOVE, started);
+    return moved;
+}
+
+/*
+    Input
+
+    On a terminal, stdin is switched to raw mode (no line buffering, no echo) so every keypress
+    is handled as soon as it arrives, without Enter. Keys are read with poll, and everything
+    that is already waiting is pulled into input_queue at once, so keys typed ahead while a turn
+    is processed are kept and handled in order. The arrow keys move like W/A/S/D, and other
+    escape sequences a terminal sends (function keys, Home, ...) are dropped whole rather than
+    read as a string of invalid keys (see input_decode).
+
+    While no key arrives, read_key returns after INPUT_TICK_MS so the game loop can run its
+    timers (see update_idle). With --tick MS, a player who has not pressed a key for MS
+    milliseconds skips the turn: the heart rate drops and the entities' move timers advance as
+    they would for E. It is off by default, because it turns the game from turn-based into
+    real-time: a player who steps away is eventually caught.
+
+    When stdin is not a terminal (piped input, or Windows), input stays in line mode: one key
+    per line, the first non-blank character counts and the rest of the line is dropped.
+
+    The terminal settings are restored by input_restore, at exit, and on fatal signals.
+*/
+#define INPUT_TICK_MS 100
+#define INPUT_NONE -1 // no key within the timeout
+#define INPUT_EOF -2  // input closed (end of file, or Ctrl-D on a terminal)
+#define INPUT_QUEUE_SIZE 64
+
+static int input_raw = 0; // 1 while the terminal is in raw mode
+#ifndef _WIN32
+static struct termios input_saved_termios;
+static unsigned char input_queue[INPUT_QUEUE_SIZE];
+static int input_head = 0, input_count = 0;
+// Where input_decode is in an escape sequence; kept across reads, which may split one
+enum input_escape_state { INPUT_PLAIN, INPUT_AFTER_ESCAPE, INPUT_IN_CSI, INPUT_IN_SS3 };
+static enum input_escape_state input_escape = INPUT_PLAIN; // the keyboard's
+
+static void input_signal_restore(int signal_number) {
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &input_saved_termios);
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+#endif
+
+void input_restore() {
+#ifndef _WIN32
+    if (input_raw) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &input_saved_termios);
+        input_raw = 0;
+    }
+#endif
+}
+
+/*
+    Switches a terminal stdin to raw mode. Anything else is left in line mode.
+
+    Returns:
+        0 on success (either mode)
+        1 on failure
+*/
+int input_init() {
+#ifndef _WIN32
+    if (!isatty(STDIN_FILENO)) {
+        return 0;
+    }
+    if (tcgetattr(STDIN_FILENO, &input_saved_termios) != 0) {
+        perror("Error reading terminal settings");
+        return 1;
     }
-    if (player_y + dy > 0 && map_dyn[player_y + dy][player_x + dx] != 1) {
-        update_player_bpm(1);
-        player_x += dx;
-        player_y += dy;
+    struct termios raw = input_saved_termios;
+    raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) {
+        perror("Error setting terminal to raw mode");
         return 1;
     }
+    input_raw = 1;
+    atexit(input_restore);
+    signal(SIGINT, input_signal_restore);
+    signal(SIGTERM, input_signal_restore);
+    signal(SIGHUP, input_signal_restore);
+#endif
     return 0;
 }
 
-int update_game() {
-    // Update game state based on player input and entity behaviors
-    // This function will handle movement, entity AI, collision detection, etc.
-    char input;
-    printf("Enter your move (W/A/S/D to move, E to skip turn, Q to check heartrate): ");
-    scanf(" %c", &input);
-    // stdin flush
+#ifndef _WIN32
+/*
+    Feeds one raw byte through the escape sequence decoder of one input (the keyboard, or a
+    host client's connection), whose state is kept in *escape. The arrow keys (ESC [ A..D, or
+    ESC O A..D in application cursor mode) become W/S/D/A. Any other CSI sequence (ESC [, then
+    parameter and intermediate bytes, then one final byte) is dropped whole. A lone ESC is
+    dropped too, and the key after it is read as usual.
+
+    Returns:
+        the key
+        INPUT_NONE if the byte belongs to an escape sequence
+*/
+static int input_decode(enum input_escape_state* escape, int byte) {
+    static const char arrow_keys[] = "WSDA"; // final bytes A, B, C, D: up, down, right, left
+    switch (*escape) {
+        case INPUT_AFTER_ESCAPE:
+            *escape = byte == '[' ? INPUT_IN_CSI : byte == 'O' ? INPUT_IN_SS3 : INPUT_PLAIN;
+            if (*escape != INPUT_PLAIN) return INPUT_NONE;
+            break;
+        case INPUT_IN_CSI:
+            if (byte >= 0x20 && byte <= 0x3f) return INPUT_NONE; // parameter and intermediate bytes
+            *escape = INPUT_PLAIN;
+            return byte >= 'A' && byte <= 'D' ? arrow_keys[byte - 'A'] : INPUT_NONE;
+        case INPUT_IN_SS3:
+            *escape = INPUT_PLAIN;
+            return byte >= 'A' && byte <= 'D' ? arrow_keys[byte - 'A'] : INPUT_NONE;
+        case INPUT_PLAIN:
+            break;
+    }
+    if (byte == 27) {
+        *escape = INPUT_AFTER_ESCAPE;
+        return INPUT_NONE;
+    }
+    return byte;
+}
+#endif
+
+/*
+    Waits up to timeout_ms for the next key (-1 waits forever). Blank keys are skipped.
+    Line mode always waits for a whole line.
+
+    Returns:
+        the key
+        INPUT_NONE if the timeout passed
+        INPUT_EOF when input is closed
+*/
+int read_key(int timeout_ms) {
+#ifndef _WIN32
+    if (input_raw) {
+        for (;;) {
+            while (input_count > 0) {
+                int key = input_decode(&input_escape, input_queue[input_head]);
+                input_head++;
+                input_count--;
+                if (key == INPUT_NONE) continue;
+                if (key == 4) return INPUT_EOF; // Ctrl-D
+                if (key != ' ' && key != '\t' && key != '\n' && key != '\r') return key;
+            }
+            struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout_ms);
+            if (ready < 0 && errno == EINTR) return INPUT_NONE;
+            if (ready < 0) return INPUT_EOF;
+            if (ready == 0) return INPUT_NONE;
+            // The queue is empty here, pull in everything typed so far
+            ssize_t got = read(STDIN_FILENO, input_queue, sizeof(input_queue));
+            if (got < 0 && errno == EINTR) return INPUT_NONE;
+            if (got <= 0) return INPUT_EOF;
+            input_head = 0;
+            input_count = (int)got;
+        }
+    }
+#endif
+    (void)timeout_ms;
+    int key;
+    do {
+        key = getchar();
+    } while (key == ' ' || key == '\t' || key == '\n' || key == '\r');
+    if (key == EOF) return INPUT_EOF;
+    // drop the rest of the line
     int c;
     while ((c = getchar()) != '\n' && c != EOF) {}
+    return key;
+}
+
+/*
+    Runs while the game waits for a key, every INPUT_TICK_MS. waited_ms is how long the player
+    has been waiting so far.
+
+    Returns:
+        1 if the player waited too long (--tick) and the entities take their turn anyway
+        0 to keep waiting
+*/
+int update_idle(struct game_session* game, uint64_t waited_ms) {
+    // A resized terminal is redrawn right away instead of on the next move
+    if (frame_is_stale()) {
+        render_game(game);
+    }
+    return game->idle_turn_ms > 0 && waited_ms >= (uint64_t)game->idle_turn_ms;
+}
+
+// Asks for the next key
+void show_prompt(struct game_session* game) {
+    fprintf(game->out, "Enter your move (W/A/S/D to move, E to skip turn, Q to check heartrate, R to redraw, P to save and quit): ");
+    fflush(game->out);
+}
+
+int update_game(struct game_session* game) {
+    // Update game state based on player input and entity behaviors
+    // This function will handle movement, entity AI, collision detection, etc.
+    show_prompt(game);
+    int key;
+    uint64_t waiting_since = clock_ns();
+    while ((key = read_key(INPUT_TICK_MS)) == INPUT_NONE) {
+        if (update_idle(game, (clock_ns() - waiting_since) / 1000000)) {
+            key = 'E'; // the turn passes as if skipped, so it is recorded and replayed as one
+            break;
+        }
+    }
+    if (key == INPUT_EOF) {
+        fprintf(game->out, "\n");
+        return 0; // input closed, end the game
+    }
+    if (input_raw) {
+        // echo the key like line mode would, so messages start on their own line
+        fprintf(game->out, "%c\n", key);
+    }
+    return play_turn(game, key);
+}
+
+/*
+    Carries out one key, from the keyboard, a headless bot or a host client: the player's
+    action, then the entities' turn if the action cost one.
+
+    Returns:
+        1 if the game goes on
+        0 if the player was caught or saved the game with P
+*/
+int play_turn(struct game_session* game, int key) {
+    uint64_t started = PROFILE_START(game);
+    char input = (char)key;
 
     // Convert char to uppercase for easier handling
     if (input >= 'a' && input <= 'z') {
         input = input - ('a' - 'A');
     }
+    replay_record(game, input);
+    PROFILE_STOP(game, PROFILE_INPUT, started);
 
     int valid_move;
 
     // Process player input
     switch (input) {
         case 'W':
-            valid_move = update_player_position(0, -1);
+            valid_move = update_player_position(game, 0, -1);
             if (valid_move) {
                 break;
             }
             return 1;
         case 'A':
-            valid_move = update_player_position(-1, 0);
+            valid_move = update_player_position(game, -1, 0);
             if (valid_move) {
                 break;
             }
             return 1;
         case 'S':
-            valid_move = update_player_position(0, 1);
+            valid_move = update_player_position(game, 0, 1);
             if (valid_move) {
                 break;
             }
             return 1;
         case 'D':
-            valid_move = update_player_position(1, 0);
+            valid_move = update_player_position(game, 1, 0);
             if (valid_move) {
                 break;
             }
             return 1;
         case 'E':
             // Do nothing, skip turn
-            update_player_bpm(0);
+            update_player_bpm(game, 0);
             break;
         case 'Q':
-            printf("Current heartrate: %d BPM\n", player_heartrate);
-            should_update_render = 0;
+            game->should_update_render = 0;
+            if (!game->headless) {
+                char message[64];
+                snprintf(message, sizeof(message), "Current heartrate: %d BPM", game->player_heartrate);
+                post_notice(game, message);
+            }
             // Checking heartrate does not cost a turn
             return 1; // continue game without incrementing score
+        case 'R':
+            // Redraw the whole screen, e.g. after it was garbled. Does not cost a turn either.
+            request_full_redraw(game);
+            game->should_update_render = 1;
+            return 1;
+        case 'P':
+            // Save and quit, to be picked up again with --resume. Bots cannot suspend.
+            game->should_update_render = 0;
+            if (game->headless || game->snapshot_path == NULL) {
+                return 1;
+            }
+            if (snapshot_save(game, game->snapshot_path) != 0) {
+                perror("Error saving the game");
+                return 1;
+            }
+            fprintf(game->out, "Game saved to %s. Continue it with --resume %s\n", game->snapshot_path, game->snapshot_path);
+            game->suspended = 1;
+            return 0;
         default:
-            printf("Invalid input. Please use W/A/S/D to move, E to skip turn, or Q to check heartrate.\n");
-            should_update_render = 0;
+            game->should_update_render = 0;
+            if (!game->headless) {
+                post_notice(game, "Invalid input. Please use W/A/S/D to move, E to skip turn, Q to check heartrate, R to redraw, or P to save and quit.");
+            }
             return 1;
     }
 
     // If we reach here, a valid action was taken that costs a turn and requires re-rendering
-    should_update_render = 1;
+    game->should_update_render = 1;
     // Add to player score each turn
-    player_score++;
+    game->player_score++;
+
+    // Entities take their turn after the player
+    game->player_moved = (input != 'E');
+    if (game->player_moved) {
+        // Moving into a hiding spot means climbing into something that closes
+        int kind = MAP_AT(game->map, game->player_x, game->player_y) == TILE_HIDING_SPOT ? NOISE_HIDE : NOISE_STEP;
+        emit_noise(game, game->player_x, game->player_y, kind, -1);
+    }
+    game->player_still_turns = game->player_moved ? 0 : game->player_still_turns + 1;
+    game->messages[0] = '\0';
+    started = PROFILE_START(game);
+    int catcher = step_entities(game);
+    PROFILE_STOP(game, PROFILE_ENTITIES, started);
+    if (catcher >= 0) {
+        char message[128];
+        snprintf(message, sizeof(message), "The %s caught you! You survived %d turns.", entity_names[game->entities.type[catcher]], game->player_score);
+        post_message(game, message);
+        return 0; // game over
+    }
     return 1; // continue game
 }
 
 
-// Define ASCII / UTF-8 symbols for walls, hiding spots, treasure chests, player, and entities
-#define SYMBOL_WALL '#'
-#define SYMBOL_FLOOR ' '
-#define SYMBOL_HIDING_SPOT 'H'
-#define SYMBOL_TREASURE_CHEST 'T'
-#define SYMBOL_PLAYER 'P'
-#define SYMBOL_ENTITY 'E'
-#define SYMBOL_HIDING_PLAYER 'S'
+/*
+    Profiling
 
+    With --profile, the hot path of every turn is timed phase by phase and each phase's times
+    go into a latency histogram:
+        input     turning the key into an action (play_turn, up to the action itself)
+        move      update_player_position
+        entities  step_entities
+        los       line_of_sight for the frame
+        render    all of render_game, los included
 
-void render_game() {
-    // Clear the console (platform-dependent)
-    // For Windows
-    (platform_clear_command_supported) ? system("cls") : system("clear");
-    
-    // Render the current game state to the console or graphical interface
-    // This function will display the map, player, entities, and other relevant information
+    The timers (PROFILE_START / PROFILE_STOP) read the monotonic clock only while profiling is
+    on; otherwise they cost one well-predicted branch each. Histogram buckets are log-linear,
+    PROFILE_SUB_BUCKETS per power of two, so a percentile is known to within 1/8th of its value
+    from a fixed table, without storing any samples. On exit (see cleanup_game) the histograms
+    are written next to the map's .catascore as <map name>.cataprofile, a JSON object with the
+    sample count, mean, p50, p99 and max of each phase, in nanoseconds.
+*/
+#define PROFILE_SUB_BITS 3
+#define PROFILE_SUB_BUCKETS (1 << PROFILE_SUB_BITS)
+#define PROFILE_BUCKETS ((64 - PROFILE_SUB_BITS + 1) * PROFILE_SUB_BUCKETS)
 
-    // Print a 21 x 21 section of the map centered around the player
-    int start_x = player_x - 10, start_y = player_y - 10, end_x = player_x + 10, end_y = player_y + 10;
-    // Ensure the section does not go out of bounds
-    if (start_x < 0) {
-        start_x = 0;
-        end_x = 20;
-    }
-    if (start_y < 0) {
-        start_y = 0;
-        end_y = 20;
-    }
-    if (end_x >= map_width) {
-        end_x = map_width - 1;
-        start_x = map_width - 21;
-    }
-    if (end_y >= map_height) {
-        end_y = map_height - 1;
-        start_y = map_height - 21;
-    }
-    // store the revealed section in player_map
-    for (int y = start_y; y <= end_y; y++) {
-        for (int x = start_x; x <= end_x; x++) {
-            player_map[y - start_y][x - start_x] = &map_dyn[y][x];
-        }
-    }
+static const char* const profile_phase_names[PROFILE_PHASES] = {
+    [PROFILE_INPUT] = "input",
+    [PROFILE_MOVE] = "move",
+    [PROFILE_ENTITIES] = "entities",
+    [PROFILE_LOS] = "los",
+    [PROFILE_RENDER] = "render",
+};
 
-    // Create local map and visibility
-    int local_map[21][21];
-    for (int y = 0; y < 21; y++) {
-        for (int x = 0; x < 21; x++) {
-            local_map[y][x] = *player_map[y][x];
-        }
-    }
-    int visibility[21][21] = {0};
-    // Calculate player's position in local coordinates
-    int player_local_x = player_x - start_x;
-    int player_local_y = player_y - start_y;
-    line_of_sight(local_map, visibility, player_local_x, player_local_y);
+struct profile_histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[PROFILE_BUCKETS];
+};
 
-    // RENDERING
-    printf("Catacombs Map:\n");
-    for (int y = 0; y <= end_y - start_y; y++) {
-        for (int x = 0; x <= end_x - start_x; x++) {
-            int global_x = start_x + x;
-            int global_y = start_y + y;
-            if (visibility[y][x] == 0) {
-                printf("? ");  // Unrevealed tile
-                continue;
+/*
+    Turns profiling on for a game, with empty histograms.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int profile_enable(struct game_session* game) {
+    game->profile = calloc(PROFILE_PHASES, sizeof(struct profile_histogram));
+    return game->profile == NULL;
+}
+
+// Nanoseconds on a monotonic clock
+uint64_t clock_ns() {
+    struct timespec now;
+#ifndef _WIN32
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+    timespec_get(&now, TIME_UTC);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Values below PROFILE_SUB_BUCKETS get a bucket each, larger ones share one per 1/8th of a power of two
+static int profile_bucket(uint64_t ns) {
+    if (ns < PROFILE_SUB_BUCKETS) return (int)ns;
+    int top = 63;
+    while (!(ns >> top)) top--;
+    int shift = top - PROFILE_SUB_BITS;
+    return (shift + 1) * PROFILE_SUB_BUCKETS + (int)((ns >> shift) & (PROFILE_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls in a bucket
+static uint64_t profile_bucket_limit(int bucket) {
+    if (bucket < PROFILE_SUB_BUCKETS) return (uint64_t)bucket;
+    int shift = bucket / PROFILE_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(PROFILE_SUB_BUCKETS + bucket % PROFILE_SUB_BUCKETS) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+void profile_record(struct game_session* game, int phase, uint64_t ns) {
+    struct profile_histogram* histogram = &game->profile[phase];
+    histogram->count++;
+    histogram->total_ns += ns;
+    if (ns > histogram->max_ns) histogram->max_ns = ns;
+    histogram->buckets[profile_bucket(ns)]++;
+}
+
+// Upper end of the bucket holding the given fraction of the samples, capped at the true maximum
+static uint64_t profile_percentile(const struct profile_histogram* histogram, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->count);
+    if (rank >= histogram->count) rank = histogram->count - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen > rank) {
+            uint64_t limit = profile_bucket_limit(b);
+            return limit < histogram->max_ns ? limit : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+// Writes text as a quoted JSON string, escaping quotes, backslashes and control characters
+static void write_json_string(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/*
+    Writes the histograms to <map name>.cataprofile.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int profile_dump(const struct game_session* game) {
+    char filename[256];
+    map_sibling_path(game->map, filename, sizeof(filename), ".cataprofile");
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        perror("Error opening profile file");
+        return 1;
+    }
+    // every turn played runs the entities once
+    fprintf(file, "{\n  \"map\": ");
+    write_json_string(file, game->map->name);
+    fprintf(file, ",\n  \"turns\": %llu,\n  \"unit\": \"ns\",\n  \"phases\": {",
+            (unsigned long long)game->profile[PROFILE_ENTITIES].count);
+    for (int phase = 0; phase < PROFILE_PHASES; phase++) {
+        const struct profile_histogram* histogram = &game->profile[phase];
+        fprintf(file, "%s\n    \"%s\": {\"count\": %llu", phase > 0 ? "," : "", profile_phase_names[phase],
+                (unsigned long long)histogram->count);
+        if (histogram->count > 0) {
+            fprintf(file, ", \"mean\": %llu, \"p50\": %llu, \"p99\": %llu, \"max\": %llu",
+                    (unsigned long long)(histogram->total_ns / histogram->count),
+                    (unsigned long long)profile_percentile(histogram, 0.50),
+                    (unsigned long long)profile_percentile(histogram, 0.99),
+                    (unsigned long long)histogram->max_ns);
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n  }\n}\n");
+    if (fclose(file) != 0) {
+        perror("Error writing profile file");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Headless simulation
+
+    Runs the game with nothing drawn and no keyboard, for measuring how many turns per second
+    the game logic manages. A bot picks each key, which goes through play_turn exactly like a
+    typed one. Every turn also works out what the player sees, as render_game would. When the
+    player is caught, a new round starts on the same map until the requested number of turns
+    has been played.
+
+    Bot policies:
+        BOT_RANDOM: a random key out of W/A/S/D/E
+        BOT_HIDE:   heads for the nearest hiding spot in sight, stays in it for BOT_HIDE_TURNS,
+                    then wanders for BOT_WANDER_TURNS before looking for the next one
+        BOT_INPUT:  keys from a file, as typed (whitespace is skipped), replayed from the start
+                    whenever the file ends
+
+    Time is taken per phase: input (the bot's choice), simulation (play_turn) and field of view.
+*/
+#define BOT_HIDE_TURNS 10
+#define BOT_WANDER_TURNS 10
+#define BOT_STUCK_LIMIT 100000 // keys in a row that cost no turn before the run is given up
+
+struct bot {
+    int policy;
+    FILE* input;
+    struct catarng rng; // kept apart from the game's rng, so the bot does not change what entities do
+    int hidden_turns;
+    int wander_turns;
+};
+
+static int bot_random_key(struct bot* bot) {
+    static const char keys[] = "WASDE";
+    return keys[random_number_range(&bot->rng, 0, 4)];
+}
+
+// Key that takes the player one step closer to (tx, ty), or a random one if both ways are blocked
+static int bot_key_toward(struct bot* bot, const struct game_session* game, int tx, int ty) {
+    int dx = tx - game->player_x, dy = ty - game->player_y;
+    int sx = (dx > 0) - (dx < 0), sy = (dy > 0) - (dy < 0);
+    int first_x = abs(dx) >= abs(dy);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int along_x = attempt == 0 ? first_x : !first_x;
+        int mx = along_x ? sx : 0, my = along_x ? 0 : sy;
+        if ((mx != 0 || my != 0) && tile_walkable(game->map, game->player_x + mx, game->player_y + my)) {
+            return mx < 0 ? 'A' : mx > 0 ? 'D' : my < 0 ? 'W' : 'S';
+        }
+    }
+    return bot_random_key(bot);
+}
+
+/*
+    Picks the bot's next key, given what the player sees: the view window starting at
+    (start_x, start_y) and its visible cells.
+
+    Returns:
+        the key
+        INPUT_EOF if the bot has nothing left to play
+*/
+static int bot_next_key(struct bot* bot, const struct game_session* game, const struct view_window* view, const view_row visible[VIEW_SIZE], int start_x, int start_y) {
+    switch (bot->policy) {
+        case BOT_HIDE: {
+            if (bot->wander_turns > 0) {
+                bot->wander_turns--;
+                return bot_random_key(bot);
+            }
+            if (MAP_AT(game->map, game->player_x, game->player_y) == TILE_HIDING_SPOT) {
+                if (++bot->hidden_turns <= BOT_HIDE_TURNS) return 'E';
+                bot->hidden_turns = 0;
+                bot->wander_turns = BOT_WANDER_TURNS;
+                return bot_random_key(bot);
+            }
+            // Nearest hiding spot in sight
+            int best = -1, best_x = 0, best_y = 0;
+            for (int y = 0; y < VIEW_SIZE; y++) {
+                view_row spots = view->hiding[y] & visible[y];
+                for (int x = 0; spots >> x; x++) {
+                    if (!(spots >> x & 1)) continue;
+                    int distance = abs(start_x + x - game->player_x) + abs(start_y + y - game->player_y);
+                    if (best < 0 || distance < best) {
+                        best = distance;
+                        best_x = start_x + x;
+                        best_y = start_y + y;
+                    }
+                }
+            }
+            return best < 0 ? bot_random_key(bot) : bot_key_toward(bot, game, best_x, best_y);
+        }
+        case BOT_INPUT:
+            for (int rewound = 0; rewound < 2; rewound++) {
+                int c;
+                while ((c = fgetc(bot->input)) != EOF) {
+                    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') return c;
+                }
+                rewind(bot->input);
+            }
+            return INPUT_EOF; // nothing but whitespace in the file
+        default:
+            return bot_random_key(bot);
+    }
+}
+
+/*
+    Plays the given number of turns with a bot on the game set up by initialize_game, then
+    prints the throughput and time spent per phase.
+
+    With a check_turn (--check-resume), the game is also saved and resumed as a second game
+    after that many turns, and both are played on with the same keys. They must stay in the
+    same state turn after turn, or the run stops with an error.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int run_headless(struct game_session* game, long long turns, int policy, const char* input_path, long long check_turn) {
+    struct bot bot;
+    memset(&bot, 0, sizeof(bot));
+    bot.policy = policy;
+    catarng_seed(&bot.rng, game->seed ^ 0x626f74ULL);
+    if (policy == BOT_INPUT) {
+        bot.input = fopen(input_path, "r");
+        if (bot.input == NULL) {
+            perror("Error opening bot input file");
+            return 1;
+        }
+    }
+
+    game->headless = 1;
+    struct game_session* resumed = NULL; // second game for check_turn
+    uint64_t input_ns = 0, simulation_ns = 0, fov_ns = 0;
+    long long played = 0, rounds = 1, idle_keys = 0;
+    int status = 0;
+    uint64_t started = clock_ns();
+    while (played < turns) {
+        uint64_t t0 = clock_ns();
+        int start_x, start_y;
+        view_origin(game->map, game->player_x, game->player_y, &start_x, &start_y);
+        struct view_window view;
+        build_view_window(game->map, &view, start_x, start_y);
+        view_row visible[VIEW_SIZE];
+        uint64_t los_started = PROFILE_START(game);
+        if (line_of_sight(&view, visible, game->player_x - start_x, game->player_y - start_y) != 0) {
+            fprintf(stderr, "Could not work out what the player sees at turn %d\n", game->player_score);
+            status = 1;
+            break;
+        }
+        PROFILE_STOP(game, PROFILE_LOS, los_started);
+        uint64_t t1 = clock_ns();
+        int key = bot_next_key(&bot, game, &view, visible, start_x, start_y);
+        uint64_t t2 = clock_ns();
+        if (key == INPUT_EOF) {
+            fprintf(stderr, "Bot input file %s has no keys\n", input_path);
+            status = 1;
+            break;
+        }
+        int score = game->player_score;
+        int alive = play_turn(game, key);
+        uint64_t t3 = clock_ns();
+        if (resumed != NULL) {
+            int resumed_alive = play_turn(resumed, key);
+            if (resumed_alive != alive || !snapshot_matches(game, resumed)) {
+                fprintf(stderr, "The game resumed at turn %lld differs from the original at turn %d\n",
+                        check_turn, game->player_score);
+                status = 1;
+                break;
+            }
+        }
+        fov_ns += t1 - t0;
+        input_ns += t2 - t1;
+        simulation_ns += t3 - t2;
+
+        if (game->player_score == score) {
+            // the key cost no turn (blocked move, heartrate check, ...)
+            if (++idle_keys >= BOT_STUCK_LIMIT) {
+                fprintf(stderr, "The bot has not taken a turn in %d keys, stopping\n", BOT_STUCK_LIMIT);
+                status = 1;
+                break;
+            }
+            continue;
+        }
+        idle_keys = 0;
+        played++;
+        if (!alive) {
+            // Caught, start a new round. A replay ends where the player is caught, so only
+            // the first round is recorded.
+            replay_record_stop(game);
+            if (place_actors(game) != 0 || (resumed != NULL && place_actors(resumed) != 0)) {
+                status = 1;
+                break;
+            }
+            rounds++;
+        }
+        if (played == check_turn) {
+            resumed = snapshot_fork(game);
+            if (resumed == NULL) {
+                fprintf(stderr, "Could not save and resume the game at turn %lld\n", check_turn);
+                status = 1;
+                break;
+            }
+        }
+    }
+    double seconds = (double)(clock_ns() - started) / 1e9;
+    game->headless = 0;
+    if (bot.input != NULL) fclose(bot.input);
+    if (resumed != NULL) {
+        if (status == 0) {
+            printf("Resume check: the game resumed at turn %lld matched the original for %lld turns\n",
+                   check_turn, played - check_turn);
+        }
+        free_game(resumed);
+        free(resumed);
+    }
+
+    double per_turn = played > 0 ? 1.0 / (double)played : 0.0;
+    printf("Headless run: %lld turns in %.3f s, %.0f turns/sec, %lld rounds (%lld captures)\n",
+           played, seconds, seconds > 0 ? (double)played / seconds : 0.0, rounds, rounds - 1);
+    printf("  %-10s %12s %12s\n", "phase", "total ms", "ns/turn");
+    printf("  %-10s %12.1f %12.1f\n", "input", (double)input_ns / 1e6, (double)input_ns * per_turn);
+    printf("  %-10s %12.1f %12.1f\n", "simulation", (double)simulation_ns / 1e6, (double)simulation_ns * per_turn);
+    printf("  %-10s %12.1f %12.1f\n", "fov", (double)fov_ns / 1e6, (double)fov_ns * per_turn);
+    return status;
+}
+
+
+/*
+    Replays
+
+    Every interactive session is recorded to a replay file of its own, by default
+    <map name>-<seed>-<time>.catareplay with the time in seconds since 1970, so earlier sessions
+    are kept; --record FILE names the file instead. Headless runs are recorded only with
+    --record, and only up to the first capture. A replay holds what is needed to play the session again
+    exactly: the seed, the map's size and tile checksum, the entity count, and the player's
+    actions. Since every random decision comes from the game's rng, the same actions on the same map
+    with the same seed always play out the same game.
+
+    Layout (version 1, little-endian, the header encoded field by field so replays play back
+    on any machine):
+        offset  size  field
+        0       8     magic, "CATAREP" followed by a NUL byte
+        8       4     format version
+        12      4     header size in bytes (offset of the actions)
+        16      8     seed
+        24      8     checksum of the map tiles (see catamap_checksum)
+        32      4     map width
+        36      4     map height
+        40      4     entity count
+        44      4     reserved, 0
+        48      ...   actions
+
+    Actions are stored as runs of the same key, each run one LEB128 varint holding
+    (length << 3) | key code, key codes being W, A, S, D, E = 0-4. Keys that never change the
+    game (heartrate checks, redraws, invalid keys) are left out, so a long session of a few
+    keys takes a handful of bytes per run.
+
+    --replay FILE plays a replay back on its map, either at full speed without drawing anything
+    or, with --step, one turn per keypress with the screen drawn after each.
+*/
+#define REPLAY_MAGIC "CATAREP"
+#define REPLAY_VERSION 1
+#define REPLAY_HEADER_SIZE 48
+#define REPLAY_KEY_BITS 3
+
+// Header in its on-disk layout, encoded field by field like a .catamap header
+static void replay_header_encode(const struct replay_header* header, unsigned char out[REPLAY_HEADER_SIZE]) {
+    memset(out, 0, REPLAY_HEADER_SIZE);
+    memcpy(out, header->magic, sizeof(header->magic));
+    catamap_put_le32(out + 8, header->version);
+    catamap_put_le32(out + 12, header->header_size);
+    catamap_put_le64(out + 16, header->seed);
+    catamap_put_le64(out + 24, header->map_checksum);
+    catamap_put_le32(out + 32, header->map_width);
+    catamap_put_le32(out + 36, header->map_height);
+    catamap_put_le32(out + 40, header->entity_count);
+}
+
+static void replay_header_decode(const unsigned char in[REPLAY_HEADER_SIZE], struct replay_header* header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, in, sizeof(header->magic));
+    header->version = catamap_get_le32(in + 8);
+    header->header_size = catamap_get_le32(in + 12);
+    header->seed = catamap_get_le64(in + 16);
+    header->map_checksum = catamap_get_le64(in + 24);
+    header->map_width = catamap_get_le32(in + 32);
+    header->map_height = catamap_get_le32(in + 36);
+    header->entity_count = catamap_get_le32(in + 40);
+}
+
+static const char replay_keys[] = "WASDE"; // key code -> key
+
+static void replay_write_varint(FILE* file, uint64_t value) {
+    unsigned char bytes[10];
+    int n = 0;
+    do {
+        bytes[n] = (unsigned char)(value & 0x7f);
+        value >>= 7;
+        if (value != 0) bytes[n] |= 0x80;
+        n++;
+    } while (value != 0);
+    fwrite(bytes, 1, (size_t)n, file);
+}
+
+/*
+    Reads one varint.
+
+    Returns:
+        0 on success
+        1 at the end of the file
+        2 if the file ends in the middle of it or it is too long
+*/
+static int replay_read_varint(FILE* file, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(file);
+        if (c == EOF) return shift == 0 ? 1 : 2;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return 2;
+}
+
+/*
+    Starts recording the session about to be played.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int replay_record_start(struct game_session* game, const char* filename) {
+    struct replay_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+    header.version = REPLAY_VERSION;
+    header.header_size = REPLAY_HEADER_SIZE;
+    header.seed = game->seed;
+    header.map_checksum = game->map->checksum;
+    header.map_width = (uint32_t)game->map->width;
+    header.map_height = (uint32_t)game->map->height;
+    header.entity_count = (uint32_t)game->entities.count;
+    unsigned char encoded[REPLAY_HEADER_SIZE];
+    replay_header_encode(&header, encoded);
+
+    game->replay_out = fopen(filename, "wb");
+    if (game->replay_out == NULL) {
+        return 1;
+    }
+    if (fwrite(encoded, sizeof(encoded), 1, game->replay_out) != 1) {
+        fclose(game->replay_out);
+        game->replay_out = NULL;
+        return 1;
+    }
+    game->replay_run_key = -1;
+    game->replay_run_length = 0;
+    return 0;
+}
+
+// Adds a key to the recording, if one is running; keys outside W/A/S/D/E are not recorded
+void replay_record(struct game_session* game, char key) {
+    const char* found = key != '\0' ? strchr(replay_keys, key) : NULL;
+    if (game->replay_out == NULL || found == NULL) return;
+    int code = (int)(found - replay_keys);
+    if (code != game->replay_run_key && game->replay_run_length > 0) {
+        replay_write_varint(game->replay_out, game->replay_run_length << REPLAY_KEY_BITS | (uint64_t)game->replay_run_key);
+        game->replay_run_length = 0;
+    }
+    game->replay_run_key = code;
+    game->replay_run_length++;
+}
+
+// Writes out the last run and closes the recording
+void replay_record_stop(struct game_session* game) {
+    if (game->replay_out == NULL) return;
+    if (game->replay_run_length > 0) {
+        replay_write_varint(game->replay_out, game->replay_run_length << REPLAY_KEY_BITS | (uint64_t)game->replay_run_key);
+    }
+    if (fclose(game->replay_out) != 0) {
+        perror("Error writing replay file");
+    }
+    game->replay_out = NULL;
+    game->replay_run_length = 0;
+}
+
+/*
+    Opens a replay and reads its header, leaving the file at the first action.
+
+    Returns:
+        the open file
+        NULL on failure (message printed to stderr)
+*/
+FILE* replay_open(const char* filename, struct replay_header* header) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror("Error opening replay file");
+        return NULL;
+    }
+    const char* error = NULL;
+    unsigned char encoded[REPLAY_HEADER_SIZE] = {0};
+    int truncated = fread(encoded, sizeof(encoded), 1, file) != 1;
+    replay_header_decode(encoded, header);
+    if (truncated) {
+        error = "truncated header";
+    } else if (memcmp(header->magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0) {
+        error = "not a replay";
+    } else if (header->version != REPLAY_VERSION) {
+        error = "unsupported replay version";
+    } else if (header->header_size < REPLAY_HEADER_SIZE || header->entity_count > INT32_MAX ||
+               fseek(file, (long)header->header_size, SEEK_SET) != 0) {
+        error = "invalid header";
+    }
+    if (error) {
+        fprintf(stderr, "Invalid replay file %s: %s\n", filename, error);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+/*
+    Plays a replay back on the game set up by initialize_game with the replay's seed and
+    entity count, then tells how the game ended. With step set, the screen is drawn after every
+    turn and the next one waits for a keypress (end of input stops the playback).
+
+    Returns:
+        0 on success
+        1 if the replay does not fit the loaded map or is damaged
+*/
+int run_replay(struct game_session* game, FILE* file, const struct replay_header* header, int step) {
+    if (header->map_width != (uint32_t)game->map->width || header->map_height != (uint32_t)game->map->height ||
+        header->map_checksum != game->map->checksum) {
+        fprintf(stderr, "The replay was recorded on a different map\n");
+        return 1;
+    }
+    if (step) {
+        if (input_init() != 0) {
+            printf("Failed to set up keyboard input. Exiting.\n");
+            return 1;
+        }
+        render_game(game);
+    }
+
+    game->headless = 1; // the game itself prints nothing while replaying
+    int alive = 1, status = 0, stopped = 0;
+    uint64_t started = clock_ns();
+    for (;;) {
+        uint64_t value;
+        int read = replay_read_varint(file, &value);
+        if (read == 1) break;
+        uint64_t length = value >> REPLAY_KEY_BITS;
+        int code = (int)(value & ((1 << REPLAY_KEY_BITS) - 1));
+        if (read == 2 || code >= (int)sizeof(replay_keys) - 1 || length == 0 || !alive) {
+            fprintf(stderr, alive ? "The replay is damaged\n" : "The replay goes on after the player was caught, it does not match this game\n");
+            status = 1;
+            break;
+        }
+        for (uint64_t k = 0; k < length && alive && !stopped; k++) {
+            if (step) {
+                printf("Replay turn %d: press any key for the next turn, Ctrl-D to stop", game->player_score + 1);
+                fflush(stdout);
+                int key;
+                while ((key = read_key(INPUT_TICK_MS)) == INPUT_NONE) {
+                    update_idle(game, 0);
+                }
+                printf("\n");
+                if (key == INPUT_EOF) {
+                    stopped = 1;
+                    break;
+                }
+            }
+            alive = play_turn(game, replay_keys[code]);
+            if (step) render_game(game);
+        }
+        if (stopped) break;
+    }
+    double seconds = (double)(clock_ns() - started) / 1e9;
+    game->headless = 0;
+
+    if (!alive) {
+        printf("%s", game->messages);
+    } else {
+        printf("Replay %s at turn %d, player at (%d, %d).\n", stopped ? "stopped" : "ended", game->player_score, game->player_x, game->player_y);
+    }
+    if (!step) {
+        printf("Replayed %d turns in %.3f s\n", game->player_score, seconds);
+    }
+    return status;
+}
+
+
+/*
+    Host mode
+
+    --host SOCKET serves games to any number of players from one process, over a local (Unix
+    domain) stream socket. Every connection is one game session. The main thread accepts
+    connections and deals them out in turn to a pool of worker threads (--workers, one per
+    processor by default); each worker waits on all of its connections at once with poll and
+    plays whichever game has input, so a game costs no thread of its own and thousands can be
+    open at the same time.
+
+    A client first sends a line naming the map to play, a .catamap file in the host's directory,
+    or an empty line for the map the host was started with. Sessions on the same map share one
+    loaded copy of it, tiles, floor index and cluster graph, which they only read; a map is
+    loaded when its first session starts and closed when its last one ends. After that every
+    byte the client sends is a key, handled like a key typed at the keyboard, and the game is
+    drawn back to the connection. Whitespace is skipped and Ctrl-D ends the game. The games of
+    a worker share its path search scratch, as it plays only one turn at a time.
+
+    Each game has its own seed, drawn from a generator seeded with --seed, and its own
+    --entities entities. Finished games are recorded on their map's scoreboard. Games that end
+    because the client went away are not scored, and host games are neither recorded as replays
+    nor saved with P. Writes to a client give up after HOST_SEND_TIMEOUT_MS, so a client that
+    stops reading only loses its own game.
+
+    SIGINT or SIGTERM stops the host: it stops accepting, ends every game without a score,
+    and removes the socket.
+*/
+#define HOST_MAPS 64             // maps loaded at once
+#define HOST_BACKLOG 128
+#define HOST_MAX_WORKERS 256
+#define HOST_TICK_MS 500         // how often the accept loop checks for a stop request
+#define HOST_SEND_TIMEOUT_MS 1000
+#define HOST_MAP_EXTENSION ".catamap"
+
+#ifndef _WIN32
+struct host {
+    pthread_mutex_t lock;        // guards everything below
+    struct game_map* maps[HOST_MAPS]; // maps in use, maps[0] is the default map
+    int map_count;
+    struct catarng rng;          // seeds of new games
+    int entity_count;
+    unsigned long long games_started;
+    unsigned long long games_scored;
+};
+
+struct host_client {
+    FILE* out;                   // the connection, written through stdio
+    int fd;
+    int playing;                 // 0 while the map line is read
+    char line[256];
+    size_t line_length;
+    enum input_escape_state escape; // arrow keys and other escape sequences, see input_decode
+    struct hpa_scratch* scratch; // the worker's, lent to the game
+    struct game_session game;
+};
+
+struct host_worker {
+    pthread_t thread;
+    struct host* host;
+    int wake[2];                 // pipe the main thread sends new connections through, closed to stop
+    struct host_client** clients;
+    size_t client_count, client_size;
+    struct hpa_scratch scratch;  // path searches of all its games, which take turns
+};
+
+static volatile sig_atomic_t host_stopping = 0;
+
+static void host_handle_stop(int signal_number) {
+    (void)signal_number;
+    host_stopping = 1;
+}
+
+// The map in use with this name, the default map for an empty one. The caller holds the lock.
+static struct game_map* host_map_find(struct host* host, const char* name) {
+    for (int m = 0; m < host->map_count; m++) {
+        if (name[0] == '\0' || strcmp(host->maps[m]->name, name) == 0) return host->maps[m];
+    }
+    return NULL;
+}
+
+// Loads a map with its floor index and cluster graph, NULL if it cannot be loaded
+static struct game_map* host_map_load(const char* name) {
+    FILE* file = fopen(name, "rb");
+    if (file == NULL) return NULL;
+    struct game_map* map = malloc(sizeof(*map));
+    if (map == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    if (read_map(map, file, name) != 0) {
+        free(map);
+        return NULL;
+    }
+    if (floor_index_build(map) != 0 || hpa_graph_build(map) != 0) {
+        close_map(map);
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+    Finds the map a client asked for, loading it if no session uses it yet, and counts the new
+    session as one of its users.
+
+    The map is loaded without holding the lock, so the other workers' games go on while a
+    large map loads. Two sessions asking for the same new map at once both load it; whichever
+    finishes second drops its copy and uses the first one.
+
+    Returns:
+        the map
+        NULL if the name is not allowed or the map cannot be loaded
+*/
+static struct game_map* host_map_acquire(struct host* host, const char* name) {
+    size_t length = strlen(name);
+    size_t extension = sizeof(HOST_MAP_EXTENSION) - 1;
+    if (length > 0 && (strchr(name, '/') != NULL || name[0] == '.' || length <= extension ||
+                       strcmp(name + length - extension, HOST_MAP_EXTENSION) != 0)) {
+        return NULL; // only maps in the host's directory
+    }
+    pthread_mutex_lock(&host->lock);
+    struct game_map* map = host_map_find(host, name);
+    int full = host->map_count >= HOST_MAPS;
+    if (map != NULL) map->users++;
+    pthread_mutex_unlock(&host->lock);
+    if (map != NULL || full) return map;
+
+    struct game_map* loaded = host_map_load(name);
+    if (loaded == NULL) return NULL;
+    pthread_mutex_lock(&host->lock);
+    map = host_map_find(host, name);
+    if (map == NULL && host->map_count < HOST_MAPS) {
+        map = loaded;
+        host->maps[host->map_count++] = map;
+        loaded = NULL;
+    }
+    if (map != NULL) map->users++;
+    pthread_mutex_unlock(&host->lock);
+    if (loaded != NULL) {
+        // Another session loaded it first, or the host filled up meanwhile
+        close_map(loaded);
+        free(loaded);
+    }
+    return map;
+}
+
+// Ends a session's use of its map, closing the map when nothing else uses it
+static void host_map_release(struct host* host, const struct game_map* released) {
+    pthread_mutex_lock(&host->lock);
+    for (int m = 0; m < host->map_count; m++) {
+        struct game_map* map = host->maps[m];
+        if (map != released) continue;
+        if (--map->users == 0 && m > 0) {
+            host->maps[m] = host->maps[--host->map_count];
+            close_map(map);
+            free(map);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&host->lock);
+}
+
+/*
+    Starts the game a client asked for with its first line.
+
+    Returns:
+        0 on success
+        1 on failure (told to the client)
+*/
+static int host_client_start(struct host* host, struct host_client* client) {
+    struct game_map* map = host_map_acquire(host, client->line);
+    if (map == NULL) {
+        fprintf(client->out, "Cannot play map \"%s\".\n", client->line);
+        return 1;
+    }
+    pthread_mutex_lock(&host->lock);
+    uint64_t seed = catarng_next(&host->rng);
+    host->games_started++;
+    pthread_mutex_unlock(&host->lock);
+    if (initialize_game(&client->game, map, client->scratch, seed, host->entity_count) != 0) {
+        host_map_release(host, map);
+        fprintf(client->out, "Failed to start a game on %s.\n", map->name);
+        return 1;
+    }
+    client->game.out = client->out;
+    client->playing = 1;
+    fprintf(client->out, "Seed: %llu\n", (unsigned long long)seed);
+    render_game(&client->game);
+    show_prompt(&client->game);
+    return 0;
+}
+
+// Ends a client's game, scored if it is over, and closes the connection
+static void host_client_close(struct host* host, struct host_client* client, int scored) {
+    if (client->playing) {
+        const struct game_map* map = client->game.map;
+        if (scored) {
+            save_scoreboard(&client->game);
+            pthread_mutex_lock(&host->lock);
+            host->games_scored++;
+            pthread_mutex_unlock(&host->lock);
+        }
+        cleanup_game(&client->game);
+        host_map_release(host, map);
+    }
+    fclose(client->out);
+    free(client);
+}
+
+/*
+    Handles bytes a client sent: the map line, then keys.
+
+    Returns:
+        1 while the game goes on
+        0 once the client should be closed, scored set if the game ended by being caught
+*/
+static int host_client_feed(struct host* host, struct host_client* client, const char* bytes, size_t length, int* scored) {
+    *scored = 0;
+    for (size_t k = 0; k < length; k++) {
+        char key = bytes[k];
+        if (!client->playing) {
+            if (key == '\r') continue;
+            if (key != '\n') {
+                if (client->line_length + 1 >= sizeof(client->line)) return 0;
+                client->line[client->line_length++] = key;
+                continue;
+            }
+            client->line[client->line_length] = '\0';
+            if (host_client_start(host, client) != 0) return 0;
+            continue;
+        }
+        int decoded = input_decode(&client->escape, (unsigned char)key);
+        if (decoded == INPUT_NONE) continue;
+        key = (char)decoded;
+        if (key == 4) return 0; // Ctrl-D
+        if (key == ' ' || key == '\t' || key == '\n' || key == '\r') continue;
+        // echo the key like the terminal would, so messages start on their own line
+        fprintf(client->out, "%c\n", key);
+        int alive = play_turn(&client->game, key);
+        if (client->game.should_update_render == 1 && render_game(&client->game) != 0) {
+            return 0;
+        }
+        if (!alive) {
+            *scored = 1;
+            return 0;
+        }
+        show_prompt(&client->game);
+    }
+    fflush(client->out);
+    return !ferror(client->out);
+}
+
+// Takes a new connection from the main thread
+static void host_worker_add(struct host_worker* worker, int fd) {
+    if (worker->client_count == worker->client_size) {
+        size_t size = worker->client_size ? 2 * worker->client_size : 64;
+        struct host_client** grown = realloc(worker->clients, sizeof(*grown) * size);
+        if (grown == NULL) {
+            close(fd);
+            return;
+        }
+        worker->clients = grown;
+        worker->client_size = size;
+    }
+    struct host_client* client = calloc(1, sizeof(*client));
+    FILE* out = client != NULL ? fdopen(fd, "w") : NULL;
+    if (out == NULL) {
+        free(client);
+        close(fd);
+        return;
+    }
+    client->out = out;
+    client->fd = fd;
+    client->scratch = &worker->scratch;
+    worker->clients[worker->client_count++] = client;
+    fprintf(out, "Catacombs. Which map? (empty line for the default): ");
+    fflush(out);
+}
+
+// Plays the games of one worker's connections until the main thread closes its pipe
+static void* host_worker_run(void* argument) {
+    struct host_worker* worker = argument;
+    struct pollfd* fds = NULL;
+    size_t fds_size = 0;
+    for (;;) {
+        size_t n = worker->client_count + 1;
+        if (n > fds_size) {
+            struct pollfd* grown = realloc(fds, sizeof(*grown) * n);
+            if (grown == NULL) break;
+            fds = grown;
+            fds_size = n;
+        }
+        fds[0] = (struct pollfd){worker->wake[0], POLLIN, 0};
+        for (size_t c = 0; c < worker->client_count; c++) {
+            fds[c + 1] = (struct pollfd){worker->clients[c]->fd, POLLIN, 0};
+        }
+        if (poll(fds, (nfds_t)n, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("Error waiting for host clients");
+            break;
+        }
+        // Walked backwards, so a closed client can be replaced by the last one
+        for (size_t c = worker->client_count; c-- > 0;) {
+            if (!(fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            struct host_client* client = worker->clients[c];
+            char bytes[256];
+            ssize_t got = read(client->fd, bytes, sizeof(bytes));
+            if (got < 0 && errno == EINTR) continue;
+            int scored = 0;
+            if (got <= 0 || !host_client_feed(worker->host, client, bytes, (size_t)got, &scored)) {
+                host_client_close(worker->host, client, scored);
+                worker->clients[c] = worker->clients[--worker->client_count];
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            int fd;
+            ssize_t got = read(worker->wake[0], &fd, sizeof(fd));
+            if (got == 0) break; // the host is stopping
+            if (got == (ssize_t)sizeof(fd)) host_worker_add(worker, fd);
+        }
+    }
+    while (worker->client_count > 0) {
+        host_client_close(worker->host, worker->clients[--worker->client_count], 0);
+    }
+    free(worker->clients);
+    free(fds);
+    hpa_scratch_free(&worker->scratch);
+    return NULL;
+}
+#endif
+
+/*
+    Serves games on socket_path until SIGINT or SIGTERM, with default_map (loaded and indexed)
+    for clients that do not name one.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int run_host(const char* socket_path, struct game_map* default_map, int workers, int entity_count, uint64_t seed) {
+#ifndef _WIN32
+    if (workers <= 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = processors > 0 ? (int)processors : 1;
+    }
+    if (workers > HOST_MAX_WORKERS) workers = HOST_MAX_WORKERS;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+    // A socket left behind by a host that did not stop cleanly is replaced, any other file is not
+    struct stat existing;
+    if (lstat(socket_path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(socket_path);
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, HOST_BACKLOG) != 0) {
+        perror("Error opening host socket");
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+
+    struct host host;
+    memset(&host, 0, sizeof(host));
+    pthread_mutex_init(&host.lock, NULL);
+    host.maps[0] = default_map;
+    host.map_count = 1;
+    catarng_seed(&host.rng, seed);
+    host.entity_count = entity_count;
+    // Filled once here, the workers only read them
+    init_ray_tables();
+
+    signal(SIGPIPE, SIG_IGN); // a client that went away fails its writes instead
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = host_handle_stop;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    struct host_worker* pool = calloc((size_t)workers, sizeof(*pool));
+    int started = 0, status = 0;
+    for (; pool != NULL && started < workers; started++) {
+        struct host_worker* worker = &pool[started];
+        worker->host = &host;
+        if (pipe(worker->wake) != 0) break;
+        if (pthread_create(&worker->thread, NULL, host_worker_run, worker) != 0) {
+            close(worker->wake[0]);
+            close(worker->wake[1]);
+            break;
+        }
+    }
+    if (started == 0) {
+        perror("Error starting host workers");
+        status = 1;
+    } else {
+        printf("Hosting games of %s on %s with %d workers, Ctrl-C to stop\n", default_map->name, socket_path, started);
+        fflush(stdout);
+    }
+
+    struct timeval send_timeout = {HOST_SEND_TIMEOUT_MS / 1000, (HOST_SEND_TIMEOUT_MS % 1000) * 1000};
+    unsigned long long accepted = 0;
+    while (started > 0 && !host_stopping) {
+        struct pollfd pfd = {listener, POLLIN, 0};
+        if (poll(&pfd, 1, HOST_TICK_MS) <= 0) continue;
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+            perror("Error accepting a host client");
+            if (errno == EMFILE || errno == ENFILE) {
+                poll(NULL, 0, HOST_TICK_MS); // out of descriptors, wait for games to end
+                continue;
+            }
+            status = 1;
+            break;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        struct host_worker* worker = &pool[accepted++ % (unsigned long long)started];
+        if (write(worker->wake[1], &fd, sizeof(fd)) != (ssize_t)sizeof(fd)) {
+            close(fd);
+        }
+    }
+
+    close(listener);
+    unlink(socket_path);
+    for (int w = 0; w < started; w++) close(pool[w].wake[1]);
+    for (int w = 0; w < started; w++) {
+        pthread_join(pool[w].thread, NULL);
+        close(pool[w].wake[0]);
+    }
+    free(pool);
+    pthread_mutex_destroy(&host.lock);
+    printf("Host stopped: %llu connections, %llu games started, %llu scored\n",
+           accepted, host.games_started, host.games_scored);
+    return status;
+#else
+    (void)socket_path;
+    (void)default_map;
+    (void)workers;
+    (void)entity_count;
+    (void)seed;
+    fprintf(stderr, "Host mode needs Unix domain sockets, it is not available on Windows\n");
+    return 1;
+#endif
+}
+
+
+/*
+    Floor index
+
+    Every floor tile inside the border walls, grouped by FLOOR_BUCKET x FLOOR_BUCKET bucket
+    and built once when the game starts. sample_floor_tile draws a uniformly random tile
+    among those that satisfy a spawn_rule, in bounded time. Buckets that lie entirely inside
+    or outside the allowed region are weighed by their tile count, and only tiles in buckets
+    that straddle the region's edge are checked one by one. If no tile qualifies, it says so
+    instead of retrying forever. Most rules allow a good share of the map, so a few plain
+    draws from the whole index are tried first; either way the pick stays uniform.
+*/
+#define FLOOR_BUCKET 32
+#define FLOOR_QUICK_DRAWS 32 // plain draws tried before the exact bucket walk
+
+#define SPAN_NONE 0 // no tile of the span is far enough
+#define SPAN_SOME 1
+#define SPAN_ALL 2
+
+/*
+    Builds the floor index of a loaded map. Sessions on the map then only read it.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int floor_index_build(struct game_map* map) {
+    struct floor_index* index = &map->floor_index;
+    memset(index, 0, sizeof(*index));
+    index->width = map->width;
+    index->buckets_x = (map->width + FLOOR_BUCKET - 1) / FLOOR_BUCKET;
+    index->buckets_y = (map->height + FLOOR_BUCKET - 1) / FLOOR_BUCKET;
+    size_t buckets = (size_t)index->buckets_x * index->buckets_y;
+    index->bucket_start = calloc(buckets + 1, sizeof(uint32_t));
+    if (index->bucket_start == NULL) return 1;
+    // Count per bucket, then lay the buckets out one after another and fill them
+    for (int y = 1; y < map->height - 1; y++) {
+        for (int x = 1; x < map->width - 1; x++) {
+            if (MAP_AT(map, x, y) == TILE_FLOOR) {
+                index->bucket_start[(y / FLOOR_BUCKET) * index->buckets_x + x / FLOOR_BUCKET + 1]++;
+            }
+        }
+    }
+    for (size_t b = 0; b < buckets; b++) {
+        index->bucket_start[b + 1] += index->bucket_start[b];
+    }
+    index->tiles = malloc(sizeof(uint32_t) * (index->bucket_start[buckets] + 1));
+    uint32_t* fill = malloc(sizeof(uint32_t) * buckets);
+    if (index->tiles == NULL || fill == NULL) {
+        free(fill);
+        free(index->tiles);
+        free(index->bucket_start);
+        memset(index, 0, sizeof(*index));
+        return 1;
+    }
+    memcpy(fill, index->bucket_start, sizeof(uint32_t) * buckets);
+    for (int y = 1; y < map->height - 1; y++) {
+        for (int x = 1; x < map->width - 1; x++) {
+            if (MAP_AT(map, x, y) == TILE_FLOOR) {
+                index->tiles[fill[(y / FLOOR_BUCKET) * index->buckets_x + x / FLOOR_BUCKET]++] = (uint32_t)y * map->width + x;
+            }
+        }
+    }
+    free(fill);
+    return 0;
+}
+
+void floor_index_free(struct floor_index* index) {
+    free(index->tiles);
+    free(index->bucket_start);
+    memset(index, 0, sizeof(*index));
+}
+
+// How much of the span [lo, hi] lies at least min away from center
+static int span_far_enough(int lo, int hi, int center, int min) {
+    if (hi <= center - min || lo >= center + min) return SPAN_ALL;
+    if (lo > center - min && hi < center + min) return SPAN_NONE;
+    return SPAN_SOME;
+}
+
+static int rule_allows(const struct spawn_rule* rule, int x, int y) {
+    int far_x = abs(x - rule->x) >= rule->min_dx, far_y = abs(y - rule->y) >= rule->min_dy;
+    return rule->both ? far_x && far_y : far_x || far_y;
+}
+
+// SPAN_ALL, SPAN_SOME or SPAN_NONE of bucket (bx, by) is allowed by the rule
+static int rule_covers_bucket(const struct spawn_rule* rule, int bx, int by) {
+    if (rule == NULL) return SPAN_ALL;
+    int x0 = bx * FLOOR_BUCKET, y0 = by * FLOOR_BUCKET;
+    int cx = span_far_enough(x0, x0 + FLOOR_BUCKET - 1, rule->x, rule->min_dx);
+    int cy = span_far_enough(y0, y0 + FLOOR_BUCKET - 1, rule->y, rule->min_dy);
+    if (rule->both) {
+        if (cx == SPAN_ALL && cy == SPAN_ALL) return SPAN_ALL;
+        if (cx == SPAN_NONE || cy == SPAN_NONE) return SPAN_NONE;
+    } else {
+        if (cx == SPAN_ALL || cy == SPAN_ALL) return SPAN_ALL;
+        if (cx == SPAN_NONE && cy == SPAN_NONE) return SPAN_NONE;
+    }
+    return SPAN_SOME;
+}
+
+/*
+    Picks a uniformly random floor tile allowed by rule (any floor tile if rule is NULL), drawing
+    from the given generator.
+    At worst takes two passes over the buckets, plus the tiles of buckets on the edge of the region.
+
+    Returns:
+        0 on success, with the tile in (*x, *y)
+        1 if no floor tile is allowed
+*/
+int sample_floor_tile(const struct floor_index* index, struct catarng* rng, const struct spawn_rule* rule, int* x, int* y) {
+    uint32_t floor_tiles = index->bucket_start[(size_t)index->buckets_x * index->buckets_y];
+    if (floor_tiles == 0) return 1;
+    for (int k = 0; k < FLOOR_QUICK_DRAWS; k++) {
+        uint32_t tile = index->tiles[catarng_bounded(rng, floor_tiles)];
+        int tx = (int)(tile % index->width), ty = (int)(tile / index->width);
+        if (rule == NULL || rule_allows(rule, tx, ty)) {
+            *x = tx;
+            *y = ty;
+            return 0;
+        }
+    }
+
+    // First pass: count the allowed tiles
+    uint64_t total = 0;
+    for (int by = 0; by < index->buckets_y; by++) {
+        for (int bx = 0; bx < index->buckets_x; bx++) {
+            int b = by * index->buckets_x + bx;
+            int cover = rule_covers_bucket(rule, bx, by);
+            if (cover == SPAN_ALL) {
+                total += index->bucket_start[b + 1] - index->bucket_start[b];
+            } else if (cover == SPAN_SOME) {
+                for (uint32_t t = index->bucket_start[b]; t < index->bucket_start[b + 1]; t++) {
+                    total += rule_allows(rule, index->tiles[t] % index->width, index->tiles[t] / index->width);
+                }
+            }
+        }
+    }
+    if (total == 0) return 1;
+
+    // Second pass: walk to the chosen one
+    uint64_t pick = catarng_bounded(rng, (uint32_t)total);
+    for (int by = 0; by < index->buckets_y; by++) {
+        for (int bx = 0; bx < index->buckets_x; bx++) {
+            int b = by * index->buckets_x + bx;
+            int cover = rule_covers_bucket(rule, bx, by);
+            uint32_t count = index->bucket_start[b + 1] - index->bucket_start[b];
+            if (cover == SPAN_ALL && pick >= count) {
+                pick -= count;
+                continue;
+            }
+            for (uint32_t t = index->bucket_start[b]; t < index->bucket_start[b + 1] && cover != SPAN_NONE; t++) {
+                int tx = (int)(index->tiles[t] % index->width), ty = (int)(index->tiles[t] / index->width);
+                if (cover == SPAN_SOME && !rule_allows(rule, tx, ty)) continue;
+                if (pick == 0) {
+                    *x = tx;
+                    *y = ty;
+                    return 0;
+                }
+                pick--;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+    Chase field
+
+    One distance field from the player's tile, shared by every entity chasing the player. It is
+    a breadth-first search (Dijkstra on a grid where every step costs 1) over walkable tiles,
+    bounded to CHASE_RADIUS steps. A chasing entity moves to whichever neighbour is closest to
+    the player, so each step costs O(1) no matter how many entities chase. Only the square of
+    tiles within CHASE_RADIUS columns and rows of the player is stored, wrapped around a fixed
+    CHASE_WINDOW x CHASE_WINDOW array, so the field is the same size on any map. When the player
+    moves, the row or column the square moves onto takes the place of the one it leaves.
+
+    When the player moves one tile, every distance changes by at most 1, and the old distance + 1
+    is still the length of a real path (through the old tile). The field stores distances as
+    value + bias, so bumping the bias raises every distance by 1 at once. The update then only
+    walks outward from the new tile over the tiles whose distance dropped, instead of rebuilding.
+    Tiles within CHASE_RADIUS stay exact. Tiles farther out can keep longer leftover lengths, so
+    those are read as CHASE_UNREACHED: what the field says depends only on where the player
+    stands, not on how they got there, and a resumed game chases exactly like the original.
+*/
+#define CHASE_UNREACHED INT32_MAX
+// Re-zero the field before the bias could overflow the stored values
+#define CHASE_BIAS_LIMIT (INT32_MAX / 2)
+
+// Sets up an empty chase field for a map
+void chase_field_init(struct chase_field* field, const struct game_map* map) {
+    memset(field, 0, sizeof(*field));
+    field->map = map;
+}
+
+static size_t chase_slot(int x, int y) {
+    return (size_t)(y % CHASE_WINDOW) * CHASE_WINDOW + (size_t)(x % CHASE_WINDOW);
+}
+
+// Steps from (x, y) to the player along the field, CHASE_UNREACHED if farther than CHASE_RADIUS
+static int32_t chase_distance(const struct chase_field* field, int x, int y) {
+    if (abs(x - field->source_x) > CHASE_RADIUS || abs(y - field->source_y) > CHASE_RADIUS) return CHASE_UNREACHED;
+    int32_t stored = field->stored[chase_slot(x, y)];
+    if (stored == CHASE_UNREACHED) return CHASE_UNREACHED;
+    int32_t distance = stored + field->bias;
+    return distance <= CHASE_RADIUS ? distance : CHASE_UNREACHED;
+}
+
+/*
+    Lowers distances outward from the source, which must already be set and queued. Only
+    tiles whose distance drops are queued, and nothing past CHASE_RADIUS.
+*/
+static void chase_field_relax(struct chase_field* field, size_t head, size_t tail) {
+    static const int dirs[4][2] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+    while (head < tail) {
+        int index = field->queue[head++];
+        int x = index % field->map->width, y = index / field->map->width;
+        int32_t next = field->stored[chase_slot(x, y)] + field->bias + 1;
+        if (next > CHASE_RADIUS) continue;
+        for (int k = 0; k < 4; k++) {
+            int nx = x + dirs[k][0], ny = y + dirs[k][1];
+            if (!tile_walkable(field->map, nx, ny)) continue;
+            int neighbour = ny * field->map->width + nx;
+            if (chase_distance(field, nx, ny) <= next) continue;
+            field->stored[chase_slot(nx, ny)] = next - field->bias;
+            field->queue[tail++] = neighbour;
+        }
+    }
+}
+
+// Brings the field up to date for the player standing on (x, y)
+void chase_field_update(struct chase_field* field, int x, int y) {
+    if (field->valid && field->source_x == x && field->source_y == y) return;
+    int adjacent = field->valid && abs(field->source_x - x) + abs(field->source_y - y) == 1;
+    if (!adjacent || field->bias >= CHASE_BIAS_LIMIT) {
+        // First search, or the player jumped: start from an empty field
+        for (size_t i = 0; i < CHASE_WINDOW * CHASE_WINDOW; i++) field->stored[i] = CHASE_UNREACHED;
+        field->bias = 0;
+    } else {
+        // Every known distance grows by one, the search below lowers the ones that shrink
+        field->bias++;
+        // The row or column moved onto reuses the slots of the one left behind, past the radius
+        if (x != field->source_x) {
+            size_t column = (size_t)(x + (x > field->source_x ? CHASE_RADIUS : CHASE_WINDOW - CHASE_RADIUS)) % CHASE_WINDOW;
+            for (size_t row = 0; row < CHASE_WINDOW; row++) field->stored[row * CHASE_WINDOW + column] = CHASE_UNREACHED;
+        } else {
+            size_t row = (size_t)(y + (y > field->source_y ? CHASE_RADIUS : CHASE_WINDOW - CHASE_RADIUS)) % CHASE_WINDOW;
+            for (size_t column = 0; column < CHASE_WINDOW; column++) field->stored[row * CHASE_WINDOW + column] = CHASE_UNREACHED;
+        }
+    }
+    field->source_x = x;
+    field->source_y = y;
+    field->valid = 1;
+    int source = y * field->map->width + x;
+    field->stored[chase_slot(x, y)] = -field->bias;
+    field->queue[0] = source;
+    chase_field_relax(field, 0, 1);
+}
+
+/*
+    Moves (x, y) one tile down the field, toward the player.
+
+    Returns:
+        1 if it moved
+        0 if (x, y) is not on the field or nothing nearer is walkable
+*/
+int chase_field_step(const struct chase_field* field, int* x, int* y) {
+    static const int dirs[4][2] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+    int32_t best = chase_distance(field, *x, *y);
+    if (best == CHASE_UNREACHED) return 0;
+    int best_k = -1;
+    for (int k = 0; k < 4; k++) {
+        int nx = *x + dirs[k][0], ny = *y + dirs[k][1];
+        if (!tile_walkable(field->map, nx, ny)) continue;
+        int32_t distance = chase_distance(field, nx, ny);
+        if (distance < best) {
+            best = distance;
+            best_k = k;
+        }
+    }
+    if (best_k < 0) return 0;
+    *x += dirs[best_k][0];
+    *y += dirs[best_k][1];
+    return 1;
+}
+
+/*
+    Hierarchical pathfinding (HPA*)
+
+    Long trips (roaming, investigating far noises) are planned on an abstract graph instead of
+    the tile grid. The map is cut into HPA_CLUSTER x HPA_CLUSTER clusters. Along every border
+    between two clusters, each run of tiles walkable on both sides is an entrance, with a
+    portal tile pair at its middle, or at both ends when the run is long. Portal tiles are the
+    graph's nodes. Nodes in the same cluster are linked with their walking distance inside the
+    cluster, and the two tiles of a portal are linked with cost 1.
+
+    hpa_next_step answers "which tile next, going from here to there". It links the two end
+    tiles to the nodes of their clusters, runs A* over the graph, refines the result into tiles
+    with small searches inside single clusters, and stores the next step of every tile of that
+    path in a cache keyed by (tile, origin, goal). A walker keeps the origin of its path in an
+    hpa_trip and hits the cache for every step after the first. Paths are the shortest ones
+    through portals, which can be a few steps longer than the true shortest path, and a path
+    planned from another tile on the way can differ. Keying by origin keeps every walker on the
+    path it set out on, so the cache only saves time and never changes where anyone goes.
+
+    Only the first HPA_TRIP_STEPS steps of a path are refined and cached. A walker that has
+    gone that far plans again from there, so cache entries stay few and a long path is never
+    refined in full.
+
+    The graph is built once per map with hpa_graph_build, next to the floor index, and games on
+    the map only read it. Each game keeps its own cache in an hpa_planner, HPA_CACHE_PER_ENTITY
+    entries per entity and at most HPA_CACHE_MAX. Searches run in an hpa_scratch, sized for the
+    largest graph it has seen, that the game borrows from whoever plays it: main for a single
+    game, each host worker for all of its games.
+*/
+#define HPA_LONG_ENTRANCE 6 // entrances at least this wide get a portal at each end
+#define HPA_CACHE_MIN (1 << 10)
+#define HPA_CACHE_MAX (1 << 20)
+#define HPA_UNREACHED INT32_MAX
+#define HPA_TRIP_STEPS (2 * HPA_CLUSTER) // steps walked on one plan before planning again
+#define HPA_NEW_STRETCH -1 // cached next step: plan again from here
+#define HPA_CACHE_PER_ENTITY (32 * HPA_TRIP_STEPS) // walkers often set out again from where they were
+
+static int hpa_cluster_of(const struct hpa_graph* graph, int x, int y) {
+    return (y / HPA_CLUSTER) * graph->clusters_x + x / HPA_CLUSTER;
+}
+
+// Bounds of the cluster holding (x, y)
+static void hpa_cluster_bounds(const struct hpa_scratch* hpa, int x, int y, int* x0, int* y0, int* x1, int* y1) {
+    *x0 = x / HPA_CLUSTER * HPA_CLUSTER;
+    *y0 = y / HPA_CLUSTER * HPA_CLUSTER;
+    *x1 = *x0 + HPA_CLUSTER < hpa->map->width ? *x0 + HPA_CLUSTER : hpa->map->width;
+    *y1 = *y0 + HPA_CLUSTER < hpa->map->height ? *y0 + HPA_CLUSTER : hpa->map->height;
+}
+
+static void hpa_local_bfs(struct hpa_scratch* hpa, int sx, int sy) {
+    static const int steps[4] = {-HPA_PADDED, 1, HPA_PADDED, -1};
+    int* queue = hpa->local_queue;
+    int32_t* padded_dist = hpa->padded_dist;
+    int x0, y0, x1, y1;
+    hpa_cluster_bounds(hpa, sx, sy, &x0, &y0, &x1, &y1);
+    int cluster = hpa_cluster_of(hpa->graph, sx, sy);
+    if (cluster != hpa->local_cluster) {
+        memset(hpa->local_open, 0, sizeof(hpa->local_open));
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                hpa->local_open[(y - y0 + 1) * HPA_PADDED + (x - x0 + 1)] = (unsigned char)tile_walkable(hpa->map, x, y);
+            }
+        }
+        hpa->local_cluster = cluster;
+    }
+    for (int i = 0; i < HPA_PADDED * HPA_PADDED; i++) padded_dist[i] = HPA_UNREACHED;
+    int head = 0, tail = 0;
+    int source = (sy - y0 + 1) * HPA_PADDED + (sx - x0 + 1);
+    padded_dist[source] = 0;
+    queue[tail++] = source;
+    while (head < tail) {
+        int cell = queue[head++];
+        for (int k = 0; k < 4; k++) {
+            int next = cell + steps[k];
+            if (padded_dist[next] != HPA_UNREACHED || !hpa->local_open[next]) continue;
+            padded_dist[next] = padded_dist[cell] + 1;
+            queue[tail++] = next;
+        }
+    }
+    for (int ly = 0; ly < HPA_CLUSTER; ly++) {
+        memcpy(&hpa->local_dist[ly * HPA_CLUSTER], &padded_dist[(ly + 1) * HPA_PADDED + 1], sizeof(int32_t) * HPA_CLUSTER);
+    }
+}
+
+static int32_t hpa_local_distance(const struct hpa_scratch* hpa, int x, int y) {
+    return hpa->local_dist[(y % HPA_CLUSTER) * HPA_CLUSTER + (x % HPA_CLUSTER)];
+}
+
+// Appends a tile to hpa->path, growing it as needed
+static int hpa_path_push(struct hpa_scratch* hpa, int tile) {
+    if (hpa->path_length == hpa->path_size) {
+        size_t size = hpa->path_size ? 2 * hpa->path_size : 256;
+        int* grown = realloc(hpa->path, sizeof(int) * size);
+        if (grown == NULL) return 1;
+        hpa->path = grown;
+        hpa->path_size = size;
+    }
+    hpa->path[hpa->path_length++] = tile;
+    return 0;
+}
+
+// Appends the tiles after (x, y) down hpa->local_dist to its source, which must be in the same cluster
+static int hpa_append_local_path(struct hpa_scratch* hpa, int x, int y) {
+    static const int dirs[4][2] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+    int32_t distance = hpa_local_distance(hpa, x, y);
+    if (distance == HPA_UNREACHED) return 1;
+    int x0, y0, x1, y1;
+    hpa_cluster_bounds(hpa, x, y, &x0, &y0, &x1, &y1);
+    while (distance > 0) {
+        for (int k = 0; k < 4; k++) {
+            int nx = x + dirs[k][0], ny = y + dirs[k][1];
+            if (nx < x0 || ny < y0 || nx >= x1 || ny >= y1) continue;
+            if (hpa_local_distance(hpa, nx, ny) == distance - 1) {
+                x = nx;
+                y = ny;
+                break;
+            }
+        }
+        distance--;
+        if (hpa_path_push(hpa, y * hpa->map->width + x) != 0) return 1;
+    }
+    return 0;
+}
+
+// Collects the portal tile pairs of every cluster border, as (a, b) tile index pairs
+static int hpa_collect_portals(const struct game_map* map, int** pairs, int* pair_count) {
+    int capacity = 1024, count = 0;
+    int* list = malloc(sizeof(int) * 2 * capacity);
+    if (list == NULL) return 1;
+    for (int vertical = 0; vertical < 2; vertical++) {
+        // vertical = 0: borders between left/right neighbours, 1: between top/bottom ones
+        int borders = vertical ? map->height : map->width;
+        int along = vertical ? map->width : map->height;
+        for (int b = HPA_CLUSTER; b < borders; b += HPA_CLUSTER) {
+            for (int start = 0; start < along; start += HPA_CLUSTER) {
+                int end = start + HPA_CLUSTER < along ? start + HPA_CLUSTER : along;
+                int run = -1;
+                for (int t = start; t <= end; t++) {
+                    int open = 0;
+                    if (t < end) {
+                        int ax = vertical ? t : b - 1, ay = vertical ? b - 1 : t;
+                        int bx = vertical ? t : b, by = vertical ? b : t;
+                        open = tile_walkable(map, ax, ay) && tile_walkable(map, bx, by);
+                    }
+                    if (open && run < 0) run = t;
+                    if (open || run < 0) continue;
+                    // run of open border tiles from run to t - 1
+                    int picks[2], pick_count = 0;
+                    if (t - run >= HPA_LONG_ENTRANCE) {
+                        picks[pick_count++] = run;
+                        picks[pick_count++] = t - 1;
+                    } else {
+                        picks[pick_count++] = (run + t - 1) / 2;
+                    }
+                    for (int p = 0; p < pick_count; p++) {
+                        if (count == capacity) {
+                            capacity *= 2;
+                            int* grown = realloc(list, sizeof(int) * 2 * capacity);
+                            if (grown == NULL) {
+                                free(list);
+                                return 1;
+                            }
+                            list = grown;
+                        }
+                        int u = picks[p];
+                        list[2 * count] = vertical ? (b - 1) * map->width + u : u * map->width + b - 1;
+                        list[2 * count + 1] = vertical ? b * map->width + u : u * map->width + b;
+                        count++;
+                    }
+                    run = -1;
+                }
+            }
+        }
+    }
+    *pairs = list;
+    *pair_count = count;
+    return 0;
+}
+
+// Sort key of a portal tile: its cluster, then the tile index
+static uint64_t hpa_tile_key(const struct game_map* map, int tile) {
+    int c = hpa_cluster_of(&map->hpa_graph, tile % map->width, tile / map->width);
+    return (uint64_t)(uint32_t)c << 32 | (uint32_t)tile;
+}
+
+static int hpa_compare_keys(const void* a, const void* b) {
+    uint64_t ka = *(const uint64_t*)a, kb = *(const uint64_t*)b;
+    return (ka > kb) - (ka < kb);
+}
+
+// Node id of a portal tile, -1 if it is not one
+static int hpa_find_node(const struct game_map* map, int tile) {
+    const struct hpa_graph* graph = &map->hpa_graph;
+    int x = tile % map->width, y = tile / map->width;
+    int c = hpa_cluster_of(graph, x, y);
+    for (int n = graph->cluster_first_node[c]; n < graph->cluster_first_node[c + 1]; n++) {
+        if (graph->nodes[n].x == x && graph->nodes[n].y == y) return n;
+    }
+    return -1;
+}
+
+void hpa_graph_free(struct hpa_graph* graph) {
+    free(graph->nodes);
+    free(graph->cluster_first_node);
+    free(graph->edges);
+    memset(graph, 0, sizeof(*graph));
+}
+
+/*
+    Builds the cluster graph of a loaded map. Sessions on the map then only read it.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int hpa_graph_build(struct game_map* map) {
+    struct hpa_graph* graph = &map->hpa_graph;
+    memset(graph, 0, sizeof(*graph));
+    graph->clusters_x = (map->width + HPA_CLUSTER - 1) / HPA_CLUSTER;
+    graph->clusters_y = (map->height + HPA_CLUSTER - 1) / HPA_CLUSTER;
+    int cluster_count = graph->clusters_x * graph->clusters_y;
+
+    // Nodes: the distinct portal tiles, sorted by cluster
+    int* pairs;
+    int pair_count;
+    if (hpa_collect_portals(map, &pairs, &pair_count) != 0) return 1;
+    uint64_t* tiles = malloc(sizeof(uint64_t) * (2 * (size_t)pair_count + 1));
+    graph->cluster_first_node = calloc((size_t)cluster_count + 1, sizeof(int));
+    if (tiles == NULL || graph->cluster_first_node == NULL) {
+        free(pairs);
+        free(tiles);
+        hpa_graph_free(graph);
+        return 1;
+    }
+    for (int i = 0; i < 2 * pair_count; i++) tiles[i] = hpa_tile_key(map, pairs[i]);
+    qsort(tiles, 2 * (size_t)pair_count, sizeof(uint64_t), hpa_compare_keys);
+    int node_count = 0;
+    for (int i = 0; i < 2 * pair_count; i++) {
+        if (node_count == 0 || tiles[node_count - 1] != tiles[i]) tiles[node_count++] = tiles[i];
+    }
+    graph->node_count = node_count;
+    graph->nodes = malloc(sizeof(struct hpa_node) * ((size_t)node_count + 1));
+    if (graph->nodes == NULL) {
+        free(pairs);
+        free(tiles);
+        hpa_graph_free(graph);
+        return 1;
+    }
+    for (int n = 0; n < node_count; n++) {
+        int tile = (int)(uint32_t)tiles[n];
+        graph->nodes[n].x = tile % map->width;
+        graph->nodes[n].y = tile / map->width;
+        graph->cluster_first_node[hpa_cluster_of(graph, graph->nodes[n].x, graph->nodes[n].y) + 1]++;
+    }
+    free(tiles);
+    for (int c = 0; c < cluster_count; c++) {
+        graph->cluster_first_node[c + 1] += graph->cluster_first_node[c];
+    }
+
+    // Edges: portal pairs link two nodes, nodes of a cluster link to each other when they can
+    // walk between them inside the cluster. Collected as (from, to, cost), then grouped by node.
+    size_t edge_count = 0, edge_capacity = 4 * (size_t)pair_count + 16;
+    int* raw = malloc(sizeof(int) * 3 * edge_capacity);
+    int* degree = calloc((size_t)node_count + 1, sizeof(int));
+    // Only the local search part is used, it needs no allocations
+    struct hpa_scratch* local = calloc(1, sizeof(*local));
+    if (raw == NULL || degree == NULL || local == NULL) {
+        free(pairs);
+        free(raw);
+        free(degree);
+        free(local);
+        hpa_graph_free(graph);
+        return 1;
+    }
+    local->map = map;
+    local->graph = graph;
+    local->local_cluster = -1;
+    for (int c = 0, p = 0; c < cluster_count || p < pair_count; c++) {
+        // make room for this cluster's edges, and the portal pairs on the last round
+        size_t cluster_nodes = c < cluster_count ? (size_t)(graph->cluster_first_node[c + 1] - graph->cluster_first_node[c]) : 0;
+        size_t needed = edge_count + cluster_nodes * cluster_nodes + (c + 1 >= cluster_count ? 2 * (size_t)pair_count : 0);
+        if (needed > edge_capacity) {
+            while (edge_capacity < needed) edge_capacity *= 2;
+            int* grown = realloc(raw, sizeof(int) * 3 * edge_capacity);
+            if (grown == NULL) {
+                free(pairs);
+                free(raw);
+                free(degree);
+                free(local);
+                hpa_graph_free(graph);
+                return 1;
+            }
+            raw = grown;
+        }
+        if (c < cluster_count) {
+            for (int n = graph->cluster_first_node[c]; n < graph->cluster_first_node[c + 1]; n++) {
+                hpa_local_bfs(local, graph->nodes[n].x, graph->nodes[n].y);
+                for (int m = graph->cluster_first_node[c]; m < graph->cluster_first_node[c + 1]; m++) {
+                    int32_t distance = hpa_local_distance(local, graph->nodes[m].x, graph->nodes[m].y);
+                    if (m == n || distance == HPA_UNREACHED) continue;
+                    int* edge = &raw[3 * edge_count++];
+                    edge[0] = n;
+                    edge[1] = m;
+                    edge[2] = distance;
+                    degree[n]++;
+                }
+            }
+        }
+        if (c + 1 >= cluster_count) {
+            for (; p < pair_count; p++) {
+                int a = hpa_find_node(map, pairs[2 * p]), b = hpa_find_node(map, pairs[2 * p + 1]);
+                int* edge = &raw[3 * edge_count++];
+                edge[0] = a;
+                edge[1] = b;
+                edge[2] = 1;
+                edge = &raw[3 * edge_count++];
+                edge[0] = b;
+                edge[1] = a;
+                edge[2] = 1;
+                degree[a]++;
+                degree[b]++;
+            }
+        }
+    }
+    free(pairs);
+    free(local);
+    int total = 0;
+    for (int n = 0; n < node_count; n++) {
+        graph->nodes[n].first_edge = total;
+        total += degree[n];
+        degree[n] = graph->nodes[n].first_edge; // now the fill position
+    }
+    graph->nodes[node_count].first_edge = total;
+    graph->edges = malloc(sizeof(struct hpa_edge) * (edge_count + 1));
+    if (graph->edges == NULL) {
+        free(raw);
+        free(degree);
+        hpa_graph_free(graph);
+        return 1;
+    }
+    for (size_t e = 0; e < edge_count; e++) {
+        graph->edges[degree[raw[3 * e]]++] = (struct hpa_edge){raw[3 * e + 1], raw[3 * e + 2]};
+    }
+    graph->edge_count = edge_count;
+    free(raw);
+    free(degree);
+    return 0;
+}
+
+void hpa_scratch_free(struct hpa_scratch* scratch) {
+    free(scratch->g);
+    free(scratch->parent);
+    free(scratch->seen);
+    free(scratch->closed);
+    free(scratch->heap);
+    free(scratch->goal_cost);
+    free(scratch->path);
+    memset(scratch, 0, sizeof(*scratch));
+}
+
+/*
+    Makes a scratch big enough to search a graph, growing it if needed. What it held before is
+    dropped, so it can be grown between any two searches.
+
+    Returns:
+        0 on success
+        1 on failure, with the scratch left as it was
+*/
+int hpa_scratch_reserve(struct hpa_scratch* scratch, const struct hpa_graph* graph) {
+    // one extra node slot for the goal
+    size_t slots = (size_t)graph->node_count + 1;
+    size_t heap_capacity = 2 * slots + graph->edge_count;
+    if (slots <= scratch->slots && heap_capacity <= scratch->heap_capacity) return 0;
+    if (slots < scratch->slots) slots = scratch->slots;
+    if (heap_capacity < scratch->heap_capacity) heap_capacity = scratch->heap_capacity;
+    int32_t* g = malloc(sizeof(int32_t) * slots);
+    int* parent = malloc(sizeof(int) * slots);
+    uint32_t* seen = calloc(slots, sizeof(uint32_t));
+    uint32_t* closed = calloc(slots, sizeof(uint32_t));
+    int* heap = malloc(sizeof(int) * heap_capacity);
+    int32_t* goal_cost = malloc(sizeof(int32_t) * slots);
+    if (g == NULL || parent == NULL || seen == NULL || closed == NULL || heap == NULL || goal_cost == NULL) {
+        free(g);
+        free(parent);
+        free(seen);
+        free(closed);
+        free(heap);
+        free(goal_cost);
+        return 1;
+    }
+    for (size_t i = 0; i < slots; i++) goal_cost[i] = HPA_UNREACHED;
+    free(scratch->g);
+    free(scratch->parent);
+    free(scratch->seen);
+    free(scratch->closed);
+    free(scratch->heap);
+    free(scratch->goal_cost);
+    scratch->g = g;
+    scratch->parent = parent;
+    scratch->seen = seen;
+    scratch->closed = closed;
+    scratch->heap = heap;
+    scratch->goal_cost = goal_cost;
+    scratch->query = 0;
+    scratch->slots = slots;
+    scratch->heap_capacity = heap_capacity;
+    return 0;
+}
+
+void hpa_planner_free(struct hpa_planner* hpa) {
+    free(hpa->cache);
+    memset(hpa, 0, sizeof(*hpa));
+}
+
+/*
+    Sets up a game's long trips on a map whose cluster graph is built, searching in the given
+    scratch. The cache is sized by the entity count, within HPA_CACHE_MIN .. HPA_CACHE_MAX.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int hpa_planner_init(struct hpa_planner* hpa, const struct game_map* map, struct hpa_scratch* scratch, int entity_count) {
+    memset(hpa, 0, sizeof(*hpa));
+    if (hpa_scratch_reserve(scratch, &map->hpa_graph) != 0) return 1;
+    size_t cache_size = HPA_CACHE_MIN;
+    while (cache_size < HPA_CACHE_MAX && cache_size < (size_t)entity_count * HPA_CACHE_PER_ENTITY) cache_size *= 2;
+    hpa->cache = calloc(cache_size, sizeof(struct hpa_cache_entry));
+    if (hpa->cache == NULL) return 1;
+    hpa->map = map;
+    hpa->scratch = scratch;
+    hpa->cache_mask = cache_size - 1;
+    return 0;
+}
+
+static size_t hpa_cache_slot(const struct hpa_planner* hpa, int32_t from, int32_t origin, int32_t goal) {
+    uint64_t key = ((uint64_t)(uint32_t)from << 32) | (uint32_t)goal;
+    key = (key ^ (uint32_t)origin) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(key >> 32) & hpa->cache_mask;
+}
+
+// Binary heap of node ids ordered by g + heuristic
+static int32_t hpa_priority(const struct hpa_scratch* hpa, int n, int goal_x, int goal_y) {
+    int x = n < hpa->graph->node_count ? hpa->graph->nodes[n].x : goal_x;
+    int y = n < hpa->graph->node_count ? hpa->graph->nodes[n].y : goal_y;
+    return hpa->g[n] + abs(x - goal_x) + abs(y - goal_y);
+}
+
+static void hpa_heap_push(struct hpa_scratch* hpa, int n, int goal_x, int goal_y) {
+    int i = hpa->heap_size++;
+    int32_t priority = hpa_priority(hpa, n, goal_x, goal_y);
+    while (i > 0) {
+        int up = (i - 1) / 2;
+        if (hpa_priority(hpa, hpa->heap[up], goal_x, goal_y) <= priority) break;
+        hpa->heap[i] = hpa->heap[up];
+        i = up;
+    }
+    hpa->heap[i] = n;
+}
+
+static int hpa_heap_pop(struct hpa_scratch* hpa, int goal_x, int goal_y) {
+    int top = hpa->heap[0];
+    int last = hpa->heap[--hpa->heap_size];
+    int32_t priority = hpa_priority(hpa, last, goal_x, goal_y);
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= hpa->heap_size) break;
+        if (child + 1 < hpa->heap_size && hpa_priority(hpa, hpa->heap[child + 1], goal_x, goal_y) < hpa_priority(hpa, hpa->heap[child], goal_x, goal_y)) child++;
+        if (hpa_priority(hpa, hpa->heap[child], goal_x, goal_y) >= priority) break;
+        hpa->heap[i] = hpa->heap[child];
+        i = child;
+    }
+    hpa->heap[i] = last;
+    return top;
+}
+
+// Sets g of node n to cost through parent if that is shorter, and queues it
+static void hpa_relax(struct hpa_scratch* hpa, int n, int32_t cost, int parent, int goal_x, int goal_y) {
+    if (hpa->closed[n] == hpa->query) return;
+    if (hpa->seen[n] == hpa->query && hpa->g[n] <= cost) return;
+    hpa->seen[n] = hpa->query;
+    hpa->g[n] = cost;
+    hpa->parent[n] = parent;
+    hpa_heap_push(hpa, n, goal_x, goal_y);
+}
+
+/*
+    Finds a path from (fx, fy) to (tx, ty) and leaves it in hpa->path, one tile index per step
+    after the start, hpa->path_length steps long. Only about the first max_length steps are
+    refined into tiles.
+
+    Returns:
+        0 on success
+        1 if there is no path
+*/
+static int hpa_search(struct hpa_scratch* hpa, int fx, int fy, int tx, int ty, size_t max_length) {
+    hpa->path_length = 0;
+    hpa->local_cluster = -1; // the last search may have been on another map
+    int start_cluster = hpa_cluster_of(hpa->graph, fx, fy), goal_cluster = hpa_cluster_of(hpa->graph, tx, ty);
+
+    // Inside one cluster, a local search is enough when it finds the goal
+    if (start_cluster == goal_cluster) {
+        hpa_local_bfs(hpa, tx, ty);
+        if (hpa_append_local_path(hpa, fx, fy) == 0) return 0;
+    }
+
+    hpa->query++;
+    if (hpa->query == 0) {
+        // stamps wrapped around, clear them once
+        memset(hpa->seen, 0, sizeof(uint32_t) * hpa->slots);
+        memset(hpa->closed, 0, sizeof(uint32_t) * hpa->slots);
+        hpa->query = 1;
+    }
+    hpa->heap_size = 0;
+    int goal = hpa->graph->node_count; // the goal tile is the extra node
+    int g_first = hpa->graph->cluster_first_node[goal_cluster], g_last = hpa->graph->cluster_first_node[goal_cluster + 1];
+    hpa_local_bfs(hpa, tx, ty);
+    for (int n = g_first; n < g_last; n++) {
+        hpa->goal_cost[n] = hpa_local_distance(hpa, hpa->graph->nodes[n].x, hpa->graph->nodes[n].y);
+    }
+    // The start tile links to the nodes of its cluster
+    hpa_local_bfs(hpa, fx, fy);
+    for (int n = hpa->graph->cluster_first_node[start_cluster]; n < hpa->graph->cluster_first_node[start_cluster + 1]; n++) {
+        int32_t distance = hpa_local_distance(hpa, hpa->graph->nodes[n].x, hpa->graph->nodes[n].y);
+        if (distance != HPA_UNREACHED) hpa_relax(hpa, n, distance, -1, tx, ty);
+    }
+
+    int found = 0;
+    while (hpa->heap_size > 0) {
+        int n = hpa_heap_pop(hpa, tx, ty);
+        if (hpa->closed[n] == hpa->query) continue;
+        hpa->closed[n] = hpa->query;
+        if (n == goal) {
+            found = 1;
+            break;
+        }
+        if (hpa->goal_cost[n] != HPA_UNREACHED) {
+            hpa_relax(hpa, goal, hpa->g[n] + hpa->goal_cost[n], n, tx, ty);
+        }
+        for (int e = hpa->graph->nodes[n].first_edge; e < hpa->graph->nodes[n + 1].first_edge; e++) {
+            hpa_relax(hpa, hpa->graph->edges[e].to, hpa->g[n] + hpa->graph->edges[e].cost, n, tx, ty);
+        }
+    }
+    for (int n = g_first; n < g_last; n++) {
+        hpa->goal_cost[n] = HPA_UNREACHED;
+    }
+    if (!found) return 1;
+
+    // Walk the node chain back from the goal, then refine it front to back
+    int chain_length = 0;
+    for (int n = hpa->parent[goal]; n >= 0; n = hpa->parent[n]) chain_length++;
+    int* chain = hpa->heap; // free again, and at least as long as any chain
+    int k = chain_length;
+    for (int n = hpa->parent[goal]; n >= 0; n = hpa->parent[n]) chain[--k] = n;
+    int x = fx, y = fy;
+    for (int i = 0; i <= chain_length; i++) {
+        int nx = i < chain_length ? hpa->graph->nodes[chain[i]].x : tx;
+        int ny = i < chain_length ? hpa->graph->nodes[chain[i]].y : ty;
+        if (abs(nx - x) + abs(ny - y) == 1 && hpa_cluster_of(hpa->graph, nx, ny) != hpa_cluster_of(hpa->graph, x, y)) {
+            // across a portal
+            if (hpa_path_push(hpa, ny * hpa->map->width + nx) != 0) return 1;
+        } else {
+            hpa_local_bfs(hpa, nx, ny);
+            if (hpa_append_local_path(hpa, x, y) != 0) return 1;
+        }
+        if (hpa->path_length >= max_length) break;
+        x = nx;
+        y = ny;
+    }
+    return 0;
+}
+
+/*
+    Plans the next stretch of a trip, up to HPA_TRIP_STEPS steps from its origin, and stores the
+    next step of every tile on it. The last tile of a stretch that does not reach the goal gets
+    HPA_NEW_STRETCH instead.
+
+    Returns:
+        0 on success, with the stretch in the scratch's path
+        1 if there is no path
+*/
+static int hpa_plan(struct hpa_planner* hpa, const struct hpa_trip* trip) {
+    struct hpa_scratch* scratch = hpa->scratch;
+    int width = hpa->map->width;
+    scratch->map = hpa->map;
+    scratch->graph = &hpa->map->hpa_graph;
+    if (hpa_search(scratch, trip->origin % width, trip->origin / width, trip->goal % width, trip->goal / width, HPA_TRIP_STEPS) != 0 ||
+        scratch->path_length == 0) {
+        return 1;
+    }
+    if (scratch->path_length > HPA_TRIP_STEPS) scratch->path_length = HPA_TRIP_STEPS;
+    int32_t tile = trip->origin;
+    for (size_t i = 0; i <= scratch->path_length; i++) {
+        int32_t next = i < scratch->path_length ? scratch->path[i] : HPA_NEW_STRETCH;
+        if (next == HPA_NEW_STRETCH && tile == trip->goal) break;
+        struct hpa_cache_entry* slot = &hpa->cache[hpa_cache_slot(hpa, tile, trip->origin, trip->goal)];
+        slot->from = tile;
+        slot->origin = trip->origin;
+        slot->goal = trip->goal;
+        slot->next = next;
+        tile = next;
+    }
+    return 0;
+}
+
+// Step after tile on the stretch hpa_plan left in hpa->path, as the cache would hold it
+static int32_t hpa_stretch_next(const struct hpa_scratch* hpa, int32_t origin, int32_t tile) {
+    int32_t next = HPA_NEW_STRETCH; // also when the tile is not on the stretch
+    int32_t at = origin;
+    for (size_t i = 0; i < hpa->path_length; i++) {
+        if (at == tile) next = hpa->path[i];
+        at = hpa->path[i];
+    }
+    if (at == tile) next = HPA_NEW_STRETCH;
+    return next;
+}
+
+/*
+    Next tile on the way from (fx, fy) to (tx, ty), both walkable, for a walker on the given
+    trip. A trip walks the path planned from its origin for HPA_TRIP_STEPS steps, then sets out
+    again from where it got to. A new goal, or a walker that left the path, also starts over.
+    The step only depends on the trip and the walker's tile, never on what the cache happens to
+    hold: a missing entry just plans the same stretch again.
+
+    Returns:
+        0 on success, with the step in (*next_x, *next_y)
+        1 if there is no path, or the two are the same tile
+*/
+int hpa_next_step(struct hpa_planner* hpa, struct hpa_trip* trip, int fx, int fy, int tx, int ty, int* next_x, int* next_y) {
+    if (fx == tx && fy == ty) return 1;
+    if (!tile_walkable(hpa->map, fx, fy) || !tile_walkable(hpa->map, tx, ty)) return 1;
+    int32_t from = fy * hpa->map->width + fx, goal = ty * hpa->map->width + tx;
+    if (trip->goal != goal || trip->origin == 0) {
+        trip->origin = from;
+        trip->goal = goal;
+    }
+    const struct hpa_cache_entry* entry = &hpa->cache[hpa_cache_slot(hpa, from, trip->origin, goal)];
+    int32_t next = entry->next;
+    if (entry->from != from || entry->origin != trip->origin || entry->goal != goal) {
+        if (hpa_plan(hpa, trip) != 0) {
+            if (trip->origin == from) return 1;
+            next = HPA_NEW_STRETCH;
+        } else {
+            next = hpa_stretch_next(hpa->scratch, trip->origin, from);
+        }
+    }
+    if (next == HPA_NEW_STRETCH) {
+        trip->origin = from;
+        if (hpa_plan(hpa, trip) != 0) return 1;
+        next = hpa->scratch->path[0];
+    }
+    *next_x = next % hpa->map->width;
+    *next_y = next / hpa->map->width;
+    return 0;
+}
+
+/*
+    Entity simulation
+
+    step_entities advances every entity by one turn, following the rules at the top of this
+    file, in three passes over the entity arrays:
+
+    1. Perception: each entity checks the player against its sense and updates its state and
+       target. Sight uses the player's field of view, computed once per turn. Sound listens to
+       the noises of the turn (see "Sound propagation").
+    2. Movement: each entity whose move timer reached its cadence (entity_rates) takes its
+       steps. Entities heading for the player follow the chase field, others walk to their
+       target along hierarchical paths. Idle ones roam toward random spots on the map.
+    3. Capture: an entity on the player's tile ends the game.
+
+    Messages for the player are posted at most once per kind per turn, however many entities
+    trigger them.
+*/
+struct entity_rates {
+    unsigned char idle_period; // turns between moves when not chasing
+    unsigned char idle_steps;  // tiles per move when not chasing
+    unsigned char aggro_period;
+    unsigned char aggro_steps;
+};
+
+static const struct entity_rates entity_rates[ENTITY_TYPES] = {
+    [ENTITY_SOUND] = {4, 1, 1, 2},
+    [ENTITY_SIGHT] = {4, 1, 2, 1},
+    [ENTITY_MOVEMENT] = {2, 1, 1, 1},
+};
+
+#define SOUND_HEARING_RANGE 10   // tiles a noise carries along a clear path
+#define SOUND_HEARTBEAT_RANGE 4  // tiles within which it hears a racing heart
+#define SOUND_HEARTBEAT_BPM 85   // heart rates above this are heard
+#define MOVEMENT_SENSE_RANGE 20  // tiles, through walls
+#define MOVEMENT_NOTIFY_RANGE 10
+#define MOVEMENT_GIVE_UP_TURNS 3 // turns of standing still before it leaves
+#define MOVEMENT_LEAVE_DISTANCE 50
+#define ENTITY_ROAM_ATTEMPTS 16
+#define ENTITY_ROAM_RADIUS 64
+
+static int chebyshev_distance(int x1, int y1, int x2, int y2) {
+    int dx = abs(x1 - x2), dy = abs(y1 - y2);
+    return dx > dy ? dx : dy;
+}
+
+/*
+    Sound propagation
+
+    Every noise (the player stepping or hiding, a racing heartbeat, an entity moving) is an event
+    in the game's noise pool. What a blind entity hears is decided by the noise's path-distance field: a
+    breadth-first search from the noise over walkable tiles, so sound does not pass through walls
+    but carries around corners and along corridors, up to the noise's radius. The field covers
+    only the square of that radius around the noise, and is worked out the first time an entity
+    within range listens, so a noise costs the same on any map size.
+
+    The pool is fixed and reused every turn. Noises from the player and heartbeat are emitted
+    during the turn, entity noises while the entities move, and all of them are heard in the next
+    perception pass and then cleared. Entity noises cannot take the slots kept for the player.
+*/
+#define SOUND_MAX_RANGE SOUND_HEARING_RANGE
+#define SOUND_SIZE (2 * SOUND_MAX_RANGE + 1)
+#define SOUND_UNHEARD 255
+#define SOUND_POOL_SIZE 64
+#define SOUND_PLAYER_RESERVE 4 // slots entity noises leave free
+
+static const unsigned char noise_radius[NOISE_KINDS] = {
+    [NOISE_STEP] = SOUND_HEARING_RANGE,
+    [NOISE_HIDE] = SOUND_HEARING_RANGE,
+    [NOISE_HEARTBEAT] = SOUND_HEARTBEAT_RANGE,
+    [NOISE_ENTITY] = SOUND_HEARING_RANGE,
+};
+
+struct noise {
+    int x, y;
+    int source; // entity index, -1 for the player
+    unsigned char kind;
+    unsigned char ready; // distance has been filled in
+    unsigned char distance[SOUND_SIZE][SOUND_SIZE]; // steps from the noise, centered on it
+};
+
+/*
+    Allocates the game's noise pool.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int noises_alloc(struct game_session* game) {
+    game->noises = malloc(sizeof(struct noise) * SOUND_POOL_SIZE);
+    game->noise_count = 0;
+    return game->noises == NULL;
+}
+
+/*
+    Queues a noise for the next perception pass.
+
+    Returns:
+        0 on success
+        1 if the pool is full and the noise was dropped
+*/
+int emit_noise(struct game_session* game, int x, int y, int kind, int source) {
+    int limit = source < 0 ? SOUND_POOL_SIZE : SOUND_POOL_SIZE - SOUND_PLAYER_RESERVE;
+    if (game->noise_count >= limit) return 1;
+    struct noise* noise = &game->noises[game->noise_count++];
+    noise->x = x;
+    noise->y = y;
+    noise->source = source;
+    noise->kind = (unsigned char)kind;
+    noise->ready = 0;
+    return 0;
+}
+
+// Fills in the path distances of a noise, out to its radius
+static void noise_propagate(const struct game_map* map, struct noise* noise) {
+    static const int dirs[4][2] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+    unsigned short queue[SOUND_SIZE * SOUND_SIZE];
+    int radius = noise_radius[noise->kind];
+    memset(noise->distance, SOUND_UNHEARD, sizeof(noise->distance));
+    noise->distance[SOUND_MAX_RANGE][SOUND_MAX_RANGE] = 0;
+    int head = 0, tail = 0;
+    queue[tail++] = SOUND_MAX_RANGE * SOUND_SIZE + SOUND_MAX_RANGE;
+    while (head < tail) {
+        int cell = queue[head++];
+        int lx = cell % SOUND_SIZE, ly = cell / SOUND_SIZE;
+        int next = noise->distance[ly][lx] + 1;
+        if (next > radius) continue;
+        for (int k = 0; k < 4; k++) {
+            int nx = lx + dirs[k][0], ny = ly + dirs[k][1];
+            // a path of length <= radius never leaves the square
+            if (noise->distance[ny][nx] != SOUND_UNHEARD) continue;
+            if (!tile_walkable(map, noise->x + nx - SOUND_MAX_RANGE, noise->y + ny - SOUND_MAX_RANGE)) continue;
+            noise->distance[ny][nx] = (unsigned char)next;
+            queue[tail++] = (unsigned short)(ny * SOUND_SIZE + nx);
+        }
+    }
+    noise->ready = 1;
+}
+
+// Steps a noise travelled to reach (x, y), SOUND_UNHEARD if it does not get there
+int noise_distance(const struct game_map* map, struct noise* noise, int x, int y) {
+    int lx = x - noise->x + SOUND_MAX_RANGE, ly = y - noise->y + SOUND_MAX_RANGE;
+    if (lx < 0 || lx >= SOUND_SIZE || ly < 0 || ly >= SOUND_SIZE) return SOUND_UNHEARD;
+    if (!noise->ready) noise_propagate(map, noise);
+    return noise->distance[ly][lx];
+}
+
+/*
+    Finds the nearest noise entity i can hear from (x, y), ignoring its own.
+
+    Returns:
+        the noise
+        NULL if it hears nothing
+*/
+struct noise* hear_noise(struct game_session* game, int i, int x, int y) {
+    struct noise* nearest = NULL;
+    int best = SOUND_UNHEARD;
+    for (int n = 0; n < game->noise_count; n++) {
+        struct noise* noise = &game->noises[n];
+        if (noise->source == i || chebyshev_distance(x, y, noise->x, noise->y) > noise_radius[noise->kind]) continue;
+        int distance = noise_distance(game->map, noise, x, y);
+        // a racing heartbeat beats any other noise
+        if (distance != SOUND_UNHEARD && (distance < best || noise->kind == NOISE_HEARTBEAT) &&
+            (nearest == NULL || nearest->kind != NOISE_HEARTBEAT)) {
+            nearest = noise;
+            best = distance;
+        }
+    }
+    return nearest;
+}
+
+// Forgets all noises once they have been heard
+void clear_noises(struct game_session* game) {
+    game->noise_count = 0;
+}
+
+/*
+    Allocates the arrays for count entities in a single zeroed block, and their grid over the map.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int entities_alloc(struct entity_set* set, int count, const struct game_map* map) {
+    memset(set, 0, sizeof(*set));
+    size_t n = (size_t)count;
+    set->block = calloc(1, n * (4 * sizeof(int) + sizeof(struct hpa_trip) + 3));
+    if (set->block == NULL && count > 0) {
+        return 1;
+    }
+    int* ints = (int*)set->block;
+    set->x = ints;
+    set->y = ints + n;
+    set->target_x = ints + 2 * n;
+    set->target_y = ints + 3 * n;
+    set->trip = (struct hpa_trip*)(ints + 4 * n);
+    unsigned char* bytes = (unsigned char*)(set->trip + n);
+    set->type = bytes;
+    set->state = bytes + n;
+    set->move_timer = bytes + 2 * n;
+    set->count = count;
+
+    struct entity_grid* grid = &set->grid;
+    grid->width = map->width;
+    grid->height = map->height;
+    grid->buckets_x = (map->width + ENTITY_GRID_BUCKET - 1) / ENTITY_GRID_BUCKET;
+    grid->buckets_y = (map->height + ENTITY_GRID_BUCKET - 1) / ENTITY_GRID_BUCKET;
+    grid->head = malloc(sizeof(int) * ((size_t)grid->buckets_x * grid->buckets_y + 3 * n));
+    if (grid->head == NULL) {
+        entities_free(set);
+        return 1;
+    }
+    grid->next = grid->head + (size_t)grid->buckets_x * grid->buckets_y;
+    grid->prev = grid->next + n;
+    grid->bucket = grid->prev + n;
+    entity_grid_rebuild(set);
+    return 0;
+}
+
+void entities_free(struct entity_set* set) {
+    free(set->block);
+    free(set->grid.head);
+    memset(set, 0, sizeof(*set));
+}
+
+/*
+    Entity grid
+
+    The map is cut into ENTITY_GRID_BUCKET x ENTITY_GRID_BUCKET buckets, each holding a doubly
+    linked list of the entities standing in it. Moving an entity relinks it in constant time, and
+    entity_at and entity_query_begin/next only walk the buckets around the tiles asked about, so
+    finding who stands somewhere no longer costs a pass over every entity.
+*/
+static int entity_grid_bucket_of(const struct entity_grid* grid, int x, int y) {
+    return (y / ENTITY_GRID_BUCKET) * grid->buckets_x + x / ENTITY_GRID_BUCKET;
+}
+
+static void entity_grid_link(struct entity_grid* grid, int i, int bucket) {
+    grid->bucket[i] = bucket;
+    grid->prev[i] = -1;
+    grid->next[i] = grid->head[bucket];
+    if (grid->head[bucket] >= 0) grid->prev[grid->head[bucket]] = i;
+    grid->head[bucket] = i;
+}
+
+static void entity_grid_unlink(struct entity_grid* grid, int i) {
+    if (grid->prev[i] >= 0) {
+        grid->next[grid->prev[i]] = grid->next[i];
+    } else {
+        grid->head[grid->bucket[i]] = grid->next[i];
+    }
+    if (grid->next[i] >= 0) grid->prev[grid->next[i]] = grid->prev[i];
+}
+
+// Files every entity under where it stands now, after placing them all at once
+void entity_grid_rebuild(struct entity_set* set) {
+    struct entity_grid* grid = &set->grid;
+    for (int b = 0; b < grid->buckets_x * grid->buckets_y; b++) {
+        grid->head[b] = -1;
+    }
+    // linked in reverse so each bucket lists its entities in index order
+    for (int i = set->count - 1; i >= 0; i--) {
+        entity_grid_link(grid, i, entity_grid_bucket_of(grid, set->x[i], set->y[i]));
+    }
+}
+
+// Updates the grid after entity i moved
+void entity_grid_move(struct entity_set* set, int i) {
+    struct entity_grid* grid = &set->grid;
+    int bucket = entity_grid_bucket_of(grid, set->x[i], set->y[i]);
+    if (bucket == grid->bucket[i]) return;
+    entity_grid_unlink(grid, i);
+    entity_grid_link(grid, i, bucket);
+}
+
+/*
+    Finds who stands on (x, y).
+
+    Returns:
+        the lowest index of the entities there
+        -1 if there is none
+*/
+int entity_at(const struct entity_set* set, int x, int y) {
+    const struct entity_grid* grid = &set->grid;
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height) return -1;
+    int found = -1;
+    for (int i = grid->head[entity_grid_bucket_of(grid, x, y)]; i >= 0; i = grid->next[i]) {
+        if (set->x[i] == x && set->y[i] == y && (found < 0 || i < found)) found = i;
+    }
+    return found;
+}
+
+// Starts walking the entities on tiles (x0, y0) to (x1, y1), clipped to the map
+void entity_query_begin(struct entity_query* query, const struct entity_set* set, int x0, int y0, int x1, int y1) {
+    const struct entity_grid* grid = &set->grid;
+    query->x0 = x0 > 0 ? x0 : 0;
+    query->y0 = y0 > 0 ? y0 : 0;
+    query->x1 = x1 < grid->width - 1 ? x1 : grid->width - 1;
+    query->y1 = y1 < grid->height - 1 ? y1 : grid->height - 1;
+    query->bx0 = query->x0 / ENTITY_GRID_BUCKET;
+    query->bx1 = query->x1 / ENTITY_GRID_BUCKET;
+    query->by1 = query->y1 / ENTITY_GRID_BUCKET;
+    query->bx = query->bx0;
+    query->by = query->y0 / ENTITY_GRID_BUCKET;
+    query->next = -1;
+    if (query->x0 > query->x1 || query->y0 > query->y1) {
+        query->by = query->by1 + 1; // empty
+    } else {
+        query->next = grid->head[query->by * grid->buckets_x + query->bx];
+    }
+}
+
+/*
+    Steps an entity_query, in no particular order.
+
+    Returns:
+        the index of the next entity inside the rectangle
+        -1 once they have all been returned
+*/
+int entity_query_next(struct entity_query* query, const struct entity_set* set) {
+    const struct entity_grid* grid = &set->grid;
+    while (query->by <= query->by1) {
+        while (query->next >= 0) {
+            int i = query->next;
+            query->next = grid->next[i];
+            if (set->x[i] >= query->x0 && set->x[i] <= query->x1 && set->y[i] >= query->y0 && set->y[i] <= query->y1) {
+                return i;
+            }
+        }
+        if (++query->bx > query->bx1) {
+            query->bx = query->bx0;
+            if (++query->by > query->by1) break;
+        }
+        query->next = grid->head[query->by * grid->buckets_x + query->bx];
+    }
+    return -1;
+}
+
+// Moves entity i one tile, toward (tx, ty) if it has a target, otherwise in a random direction
+static void entity_step_toward(struct game_session* game, int i, int has_target, int tx, int ty) {
+    static const int dirs[4][2] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+    struct entity_set* set = &game->entities;
+    int x = set->x[i], y = set->y[i];
+    if (has_target) {
+        int dx = tx - x, dy = ty - y;
+        if (dx == 0 && dy == 0) return;
+        // Try the axis with the longer way to go first, then the other one
+        int sx = (dx > 0) - (dx < 0), sy = (dy > 0) - (dy < 0);
+        int first_x = abs(dx) >= abs(dy);
+        for (int attempt = 0; attempt < 2; attempt++) {
+            int along_x = attempt == 0 ? first_x : !first_x;
+            int nx = x + (along_x ? sx : 0), ny = y + (along_x ? 0 : sy);
+            if ((nx != x || ny != y) && tile_walkable(game->map, nx, ny)) {
+                set->x[i] = nx;
+                set->y[i] = ny;
+                return;
+            }
+        }
+    }
+    // Wander, or squeeze around whatever blocks the direct way
+    int start = random_number_range(&game->rng, 0, 3);
+    for (int k = 0; k < 4; k++) {
+        const int* d = dirs[(start + k) & 3];
+        if (tile_walkable(game->map, x + d[0], y + d[1])) {
+            set->x[i] = x + d[0];
+            set->y[i] = y + d[1];
+            return;
+        }
+    }
+}
+
+// 1 if idle entity i is still on its way to a roaming spot
+static int entity_has_roam_target(const struct game_session* game, int i) {
+    const struct entity_set* set = &game->entities;
+    return (set->x[i] != set->target_x[i] || set->y[i] != set->target_y[i]) &&
+           tile_walkable(game->map, set->target_x[i], set->target_y[i]);
+}
+
+/*
+    Sends idle entity i roaming toward a random walkable tile up to ENTITY_ROAM_RADIUS away, if
+    one turns up. One leg after another, entities cover the whole map, while each leg stays
+    short enough to plan quickly and to fit in the path cache.
+*/
+static void entity_pick_roam_target(struct game_session* game, int i) {
+    struct entity_set* set = &game->entities;
+    const struct game_map* map = game->map;
+    int x0 = set->x[i] - ENTITY_ROAM_RADIUS > 1 ? set->x[i] - ENTITY_ROAM_RADIUS : 1;
+    int y0 = set->y[i] - ENTITY_ROAM_RADIUS > 1 ? set->y[i] - ENTITY_ROAM_RADIUS : 1;
+    int x1 = set->x[i] + ENTITY_ROAM_RADIUS < map->width - 2 ? set->x[i] + ENTITY_ROAM_RADIUS : map->width - 2;
+    int y1 = set->y[i] + ENTITY_ROAM_RADIUS < map->height - 2 ? set->y[i] + ENTITY_ROAM_RADIUS : map->height - 2;
+    for (int attempt = 0; attempt < ENTITY_ROAM_ATTEMPTS; attempt++) {
+        int x = random_number_range(&game->rng, x0, x1);
+        int y = random_number_range(&game->rng, y0, y1);
+        if (tile_walkable(map, x, y) && (x != set->x[i] || y != set->y[i])) {
+            set->target_x[i] = x;
+            set->target_y[i] = y;
+            return;
+        }
+    }
+}
+
+/*
+    Moves entity i to a random floor tile at least MOVEMENT_LEAVE_DISTANCE from the player.
+
+    Returns:
+        0 on success
+        1 if the map has no such tile (the entity stays put)
+*/
+static int entity_relocate(struct game_session* game, int i) {
+    struct entity_set* set = &game->entities;
+    struct spawn_rule far_away = {game->player_x, game->player_y, MOVEMENT_LEAVE_DISTANCE, MOVEMENT_LEAVE_DISTANCE, 0};
+    return sample_floor_tile(&game->map->floor_index, &game->rng, &far_away, &set->x[i], &set->y[i]);
+}
+
+/*
+    Advances all entities by one turn.
+
+    Returns:
+        the index of the entity that caught the player
+        -1 if the player is still free
+*/
+int step_entities(struct game_session* game) {
+    struct entity_set* set = &game->entities;
+    // The player's field of view, shared by every entity that needs a clear line to the player
+    int start_x, start_y;
+    view_origin(game->map, game->player_x, game->player_y, &start_x, &start_y);
+    struct view_window view;
+    build_view_window(game->map, &view, start_x, start_y);
+    view_row los[VIEW_SIZE];
+    field_of_view(&view, game->player_x - start_x, game->player_y - start_y, VIEW_RADIUS, los);
+
+    int spotted = 0, heard = 0, sensed = 0;
+    if (game->player_heartrate > SOUND_HEARTBEAT_BPM) {
+        emit_noise(game, game->player_x, game->player_y, NOISE_HEARTBEAT, -1);
+    }
+
+    // Movement is felt through walls, by whoever stands close enough
+    if (game->player_moved) {
+        struct entity_query near;
+        entity_query_begin(&near, set, game->player_x - MOVEMENT_SENSE_RANGE, game->player_y - MOVEMENT_SENSE_RANGE,
+                           game->player_x + MOVEMENT_SENSE_RANGE, game->player_y + MOVEMENT_SENSE_RANGE);
+        for (int i = entity_query_next(&near, set); i >= 0; i = entity_query_next(&near, set)) {
+            if (set->type[i] != ENTITY_MOVEMENT) continue;
+            set->state[i] = ENTITY_AGGRO;
+            if (chebyshev_distance(set->x[i], set->y[i], game->player_x, game->player_y) <= MOVEMENT_NOTIFY_RANGE) sensed = 1;
+        }
+    }
+
+    // 1. Perception
+    for (int i = 0; i < set->count; i++) {
+        int x = set->x[i], y = set->y[i];
+        int lx = x - start_x, ly = y - start_y;
+        int in_sight = lx >= 0 && lx < VIEW_SIZE && ly >= 0 && ly < VIEW_SIZE && (los[ly] >> lx & 1);
+        switch (set->type[i]) {
+            case ENTITY_SIGHT:
+                // Sees through the cracks of hiding spots, standing still does not help
+                if (in_sight) {
+                    set->state[i] = ENTITY_AGGRO;
+                    spotted = 1;
+                }
+                break;
+            case ENTITY_SOUND: {
+                struct noise* noise = hear_noise(game, i, x, y);
+                if (noise != NULL && noise->kind == NOISE_HEARTBEAT) {
+                    set->state[i] = ENTITY_AGGRO;
+                } else if (noise != NULL) {
+                    // Investigates any sound, whatever made it
+                    if (set->state[i] != ENTITY_AGGRO) set->state[i] = ENTITY_INVESTIGATE;
+                } else if (set->state[i] == ENTITY_AGGRO) {
+                    // Lost the heartbeat, check out where it was last heard
+                    set->state[i] = ENTITY_INVESTIGATE;
+                }
+                if (noise != NULL) {
+                    set->target_x[i] = noise->x;
+                    set->target_y[i] = noise->y;
+                    if (noise->source < 0) heard = 1;
+                }
+                continue;
+            }
+            case ENTITY_MOVEMENT:
+                if (set->state[i] == ENTITY_AGGRO && game->player_still_turns >= MOVEMENT_GIVE_UP_TURNS) {
+                    // Lost interest, it leaves for somewhere far away
+                    entity_relocate(game, i); // stays put if the map has nowhere far enough
+                    entity_grid_move(set, i);
+                    set->state[i] = ENTITY_IDLE;
+                    continue;
+                }
+                if (chebyshev_distance(x, y, game->player_x, game->player_y) > MOVEMENT_SENSE_RANGE) {
+                    // Out of range it cannot tell where the player went, keeps heading for the last spot
+                    continue;
+                }
+                break;
+        }
+        if (set->state[i] != ENTITY_IDLE && (in_sight || set->type[i] != ENTITY_SIGHT)) {
+            // Sensed this turn, head for where the player is now
+            set->target_x[i] = game->player_x;
+            set->target_y[i] = game->player_y;
+        }
+    }
+
+    // Everything queued so far has been heard, the entities' own steps are heard next turn
+    clear_noises(game);
+
+    // 2. Movement
+    for (int i = 0; i < set->count; i++) {
+        const struct entity_rates* rates = &entity_rates[set->type[i]];
+        int aggro = set->state[i] == ENTITY_AGGRO;
+        int period = aggro ? rates->aggro_period : rates->idle_period;
+        int steps = aggro ? rates->aggro_steps : rates->idle_steps;
+        if (set->move_timer[i] < 255) set->move_timer[i]++;
+        if (set->move_timer[i] < period) continue;
+        set->move_timer[i] = 0;
+        for (int k = 0; k < steps; k++) {
+            int has_target = set->state[i] != ENTITY_IDLE;
+            if (!has_target && !entity_has_roam_target(game, i)) {
+                entity_pick_roam_target(game, i);
+            }
+            if (has_target && set->target_x[i] == game->player_x && set->target_y[i] == game->player_y) {
+                // Heading for the player, follow the shared chase field while it reaches this far
+                chase_field_update(&game->chase_field, game->player_x, game->player_y);
+                if (chase_field_step(&game->chase_field, &set->x[i], &set->y[i])) {
+                    if (set->x[i] == game->player_x && set->y[i] == game->player_y) break;
+                    continue;
+                }
             }
-            if (global_x == player_x && global_y == player_y) {
-                // Update player hidden status based on current tile
-                player_hidden = (*player_map[y][x] == 2) ? 1 : 0;
-                (player_hidden) ? printf("%c ", SYMBOL_HIDING_PLAYER) : printf("%c ", SYMBOL_PLAYER);
+            int next_x, next_y;
+            if (hpa_next_step(&game->hpa, &set->trip[i], set->x[i], set->y[i], set->target_x[i], set->target_y[i], &next_x, &next_y) == 0) {
+                set->x[i] = next_x;
+                set->y[i] = next_y;
             } else {
-                int is_entity_here = 0;
-                for (int i = 0; i < 3; i++) {
-                    if (entity_positions[i][0] == global_x && entity_positions[i][1] == global_y) {
-                        is_entity_here = 1;
-                        break;
-                    }
+                // No known way there, head straight for it or wander
+                entity_step_toward(game, i, has_target, set->target_x[i], set->target_y[i]);
+                if (!has_target) {
+                    // give up on an unreachable roaming spot
+                    set->target_x[i] = set->x[i];
+                    set->target_y[i] = set->y[i];
                 }
-                if (is_entity_here) {
-                    printf("%c ", SYMBOL_ENTITY);
-                } else {
-                    switch (*player_map[y][x]) {
-                        case 0:
-                            printf("%c ", SYMBOL_FLOOR);
-                            break;
-                        case 1:
-                            printf("%c ", SYMBOL_WALL);
-                            break;
-                        case 2:
-                            printf("%c ", SYMBOL_HIDING_SPOT);
-                            break;
-                        case 3:
-                            printf("%c ", SYMBOL_TREASURE_CHEST);
-                            break;
-                        default:
-                            printf("? ");
-                            break;
-                    }
+            }
+            if (has_target && set->x[i] == set->target_x[i] && set->y[i] == set->target_y[i]) {
+                // Reached the spot, nothing here anymore unless it senses the player again
+                set->state[i] = ENTITY_IDLE;
+            }
+            if (set->x[i] == game->player_x && set->y[i] == game->player_y) break;
+        }
+        entity_grid_move(set, i);
+        emit_noise(game, set->x[i], set->y[i], NOISE_ENTITY, i);
+    }
+
+    if (spotted) post_message(game, "You spot something that stands out brightly against the dull catacombs.");
+    if (heard) post_message(game, "Metal shoes tap against the ground...");
+    if (sensed) post_message(game, "You hear chains clatter and a blade screeching against the stone floors...");
+
+    // 3. Capture
+    return entity_at(set, game->player_x, game->player_y);
+}
+
+// Adds a line to the messages shown under the map on the next frame
+void post_message(struct game_session* game, const char* message) {
+    size_t used = strlen(game->messages);
+    snprintf(game->messages + used, sizeof(game->messages) - used, "%s\n", message);
+}
+
+// Answers a key that does not cost a turn: the message replaces those of the turn and the frame
+// is drawn again to show it. Printed on its own it would scroll the frame the next diff assumes.
+void post_notice(struct game_session* game, const char* message) {
+    game->messages[0] = '\0';
+    post_message(game, message);
+    game->should_update_render = 1;
+}
+
+// Define ASCII / UTF-8 symbols for walls, hiding spots, treasure chests, player, and entities
+#define SYMBOL_WALL '#'
+#define SYMBOL_FLOOR ' '
+#define SYMBOL_HIDING_SPOT 'H'
+#define SYMBOL_TREASURE_CHEST 'T'
+#define SYMBOL_PLAYER 'P'
+#define SYMBOL_ENTITY 'E'
+#define SYMBOL_HIDING_PLAYER 'S'
+#define SYMBOL_UNKNOWN '?'
+
+// Map tile value -> symbol; values past the table render as SYMBOL_UNKNOWN
+static const char tile_symbols[] = {
+    [TILE_FLOOR] = SYMBOL_FLOOR,
+    [TILE_WALL] = SYMBOL_WALL,
+    [TILE_HIDING_SPOT] = SYMBOL_HIDING_SPOT,
+    [TILE_TREASURE_CHEST] = SYMBOL_TREASURE_CHEST,
+};
+#define TILE_SYMBOL(tile) ((tile) < sizeof(tile_symbols) ? tile_symbols[(tile)] : SYMBOL_UNKNOWN)
+
+/*
+    Frame buffer
+
+    Each frame is composed into one buffer on the stack and sent to the game's output with a
+    single write, instead of clearing through a shell and printing tile by tile.
+
+    Each game keeps the cells of the last frame it drew. When the terminal is known to still
+    show that frame, only the cells that changed are sent, each run placed with an ANSI cursor
+    position sequence, followed by the status line. Everything below the status line (the move
+    prompt, messages) is erased so the screen ends up exactly as after a full redraw.
+
+    A full redraw (ANSI cursor-home and erase, then every cell) happens on the first frame,
+    after a terminal resize, on request (see request_full_redraw), and always when stdout is not
+    a terminal or the terminal is too short to hold the frame without scrolling. Games drawing
+    to another stream (host mode clients) cannot be asked for their terminal size, and always
+    get diffs once their first frame is drawn.
+*/
+#define ANSI_CLEAR_SCREEN "\x1b[H\x1b[2J"
+#define ANSI_ERASE_LINE "\x1b[2K"
+#define ANSI_ERASE_BELOW "\x1b[J"
+#define ANSI_CURSOR_SIZE 16 // longest "\x1b[row;colH" sequence, with room to spare
+#define FRAME_TITLE "Catacombs Map:\n"
+#define FRAME_TOP_ROW 2 // terminal row (1-based) of the first view row, below the title
+// Rows a terminal needs to show title, view, status, a few messages, the prompt (wrapped on
+// narrow terminals) and the echoed input without scrolling
+#define FRAME_TERMINAL_ROWS (VIEW_SIZE + 9)
+#define FRAME_STATUS_SIZE (128 + GAME_MESSAGES_SIZE) // status line and messages
+#define FRAME_BUFFER_SIZE (sizeof(ANSI_CLEAR_SCREEN) + sizeof(FRAME_TITLE) + \
+                           VIEW_SIZE * VIEW_SIZE * (ANSI_CURSOR_SIZE + 2) + VIEW_SIZE + \
+                           ANSI_CURSOR_SIZE + sizeof(ANSI_ERASE_LINE) + FRAME_STATUS_SIZE + sizeof(ANSI_ERASE_BELOW))
+
+#ifndef _WIN32
+static volatile sig_atomic_t frame_resized = 0;
+
+static void handle_resize(int signal_number) {
+    (void)signal_number;
+    frame_resized = 1;
+}
+#endif
+
+// Makes the next render_game redraw the whole screen
+void request_full_redraw(struct game_session* game) {
+    game->frame_width = 0;
+    game->frame_height = 0;
+}
+
+// 1 if the terminal was resized since the last frame
+int frame_is_stale() {
+#ifndef _WIN32
+    return frame_resized != 0;
+#else
+    return 0;
+#endif
+}
+
+// 1 if the terminal still shows the last frame and can take a diff
+static int frame_can_diff(struct game_session* game, int width, int height) {
+    if (game->frame_width != width || game->frame_height != height) {
+        return 0;
+    }
+    if (game->out != stdout) {
+        return 1;
+    }
+#ifndef _WIN32
+    static int watching_resize = 0;
+    if (!watching_resize) {
+        signal(SIGWINCH, handle_resize);
+        watching_resize = 1;
+    }
+    if (frame_resized) {
+        frame_resized = 0;
+        return 0;
+    }
+    if (!isatty(STDOUT_FILENO)) {
+        return 0;
+    }
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0 || size.ws_row < FRAME_TERMINAL_ROWS) {
+        return 0;
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+    Writes a whole buffer to the game's output, retrying short writes.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static int write_frame(FILE* out, const char* buffer, size_t length) {
+    // Anything still queued in stdio (prompts, messages) goes out before the frame
+    fflush(out);
+#ifndef _WIN32
+    int fd = fileno(out);
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        buffer += written;
+        length -= (size_t)written;
+    }
+    return 0;
+#else
+    int failed = fwrite(buffer, 1, length, out) != length;
+    return fflush(out) != 0 || failed;
+#endif
+}
+
+// Appends a string literal to the frame
+#define FRAME_APPEND(out, literal) (memcpy((out), (literal), sizeof(literal) - 1), (out) += sizeof(literal) - 1)
+
+/*
+    Draws a frame of width x height symbols and its status line, either in full or as a diff
+    against the last frame drawn.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static int present_frame(struct game_session* game, char cells[VIEW_SIZE][VIEW_SIZE], int width, int height, const char* status) {
+    char frame_buffer[FRAME_BUFFER_SIZE];
+    char* out = frame_buffer;
+    if (frame_can_diff(game, width, height)) {
+        for (int y = 0; y < height; y++) {
+            int cursor_x = -1; // view column the terminal cursor sits on, -1 if elsewhere
+            for (int x = 0; x < width; x++) {
+                if (cells[y][x] == game->frame_cells[y][x]) continue;
+                if (x != cursor_x) {
+                    out += sprintf(out, "\x1b[%d;%dH", FRAME_TOP_ROW + y, 2 * x + 1);
                 }
+                *out++ = cells[y][x];
+                *out++ = ' ';
+                cursor_x = x + 1;
+            }
+        }
+        out += sprintf(out, "\x1b[%d;1H", FRAME_TOP_ROW + height);
+        FRAME_APPEND(out, ANSI_ERASE_LINE);
+    } else {
+        FRAME_APPEND(out, ANSI_CLEAR_SCREEN FRAME_TITLE);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                *out++ = cells[y][x];
+                *out++ = ' ';
+            }
+            *out++ = '\n';
+        }
+    }
+    out += snprintf(out, FRAME_STATUS_SIZE, "%s", status);
+    FRAME_APPEND(out, ANSI_ERASE_BELOW);
+
+    memcpy(game->frame_cells, cells, sizeof(game->frame_cells));
+    game->frame_width = width;
+    game->frame_height = height;
+    if (write_frame(game->out, frame_buffer, (size_t)(out - frame_buffer)) != 0) {
+        // The screen is in an unknown state, start over next time
+        request_full_redraw(game);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Draws the game: the view around the player, the status line and the messages of the turn.
+
+    Returns:
+        0 on success
+        1 if the frame could not be built or written (e.g. a host client went away)
+*/
+int render_game(struct game_session* game) {
+    // Render the current game state to the console or graphical interface
+    // This function will display the map, player, entities, and other relevant information
+    const struct game_map* map = game->map;
+
+    uint64_t started = PROFILE_START(game);
+    // Print a VIEW_SIZE x VIEW_SIZE section of the map centered around the player
+    int start_x, start_y;
+    view_origin(map, game->player_x, game->player_y, &start_x, &start_y);
+    int end_x = start_x + VIEW_SIZE - 1, end_y = start_y + VIEW_SIZE - 1;
+
+    // Create the window masks and visibility
+    struct view_window view;
+    build_view_window(map, &view, start_x, start_y);
+    view_row visibility[VIEW_SIZE];
+    // Calculate player's position in local coordinates
+    int player_local_x = game->player_x - start_x;
+    int player_local_y = game->player_y - start_y;
+    uint64_t los_started = PROFILE_START(game);
+    if (line_of_sight(&view, visibility, player_local_x, player_local_y) != 0) {
+        return 1;
+    }
+    PROFILE_STOP(game, PROFILE_LOS, los_started);
+
+    // Entities inside the window, as row masks
+    const struct entity_set* entities = &game->entities;
+    view_row entity_rows[VIEW_SIZE] = {0};
+    struct entity_query in_window;
+    entity_query_begin(&in_window, entities, start_x, start_y, end_x, end_y);
+    for (int i = entity_query_next(&in_window, entities); i >= 0; i = entity_query_next(&in_window, entities)) {
+        entity_rows[entities->y[i] - start_y] |= (view_row)1 << (entities->x[i] - start_x);
+    }
+    // Update player hidden status based on current tile
+    game->player_hidden = (MAP_AT(map, game->player_x, game->player_y) == TILE_HIDING_SPOT) ? 1 : 0;
+
+    // RENDERING
+    char cells[VIEW_SIZE][VIEW_SIZE];
+    for (int y = 0; y <= end_y - start_y; y++) {
+        for (int x = 0; x <= end_x - start_x; x++) {
+            if (!(visibility[y] >> x & 1)) {
+                cells[y][x] = SYMBOL_UNKNOWN;  // Unrevealed tile
+            } else if (x == player_local_x && y == player_local_y) {
+                cells[y][x] = (game->player_hidden) ? SYMBOL_HIDING_PLAYER : SYMBOL_PLAYER;
+            } else if (entity_rows[y] >> x & 1) {
+                cells[y][x] = SYMBOL_ENTITY;
+            } else {
+                cells[y][x] = TILE_SYMBOL(MAP_AT(map, start_x + x, start_y + y));
             }
         }
-        printf("\n");
     }
-    // END RENDERING
+    char status[FRAME_STATUS_SIZE];
+    snprintf(status, sizeof(status), "Player Position: (%d, %d) | Turn: %d\n%s", game->player_x, game->player_y, game->player_score, game->messages);
+    int failed = present_frame(game, cells, end_x - start_x + 1, end_y - start_y + 1, status);
+    // END RENDERING
+    PROFILE_STOP(game, PROFILE_RENDER, started);
+    return failed;
+}
+
+// Frees everything the game allocated, and writes its profile if it has one. The map is left to its owner.
+void cleanup_game(struct game_session* game) {
+    // Cleanup resources and perform any necessary shutdown procedures
+    fprintf(game->out, "Cleaning up game resources...\n");
+    fflush(game->out);
+    // Give the terminal back in line mode
+    input_restore();
+    replay_record_stop(game);
+    if (game->profile != NULL) {
+        profile_dump(game);
+    }
+    free_game(game);
+}
+
+// Frees what initialize_game allocated, also after it failed halfway
+void free_game(struct game_session* game) {
+    // Free the entity arrays in one call
+    entities_free(&game->entities);
+    hpa_planner_free(&game->hpa);
+    free(game->noises);
+    game->noises = NULL;
+    free(game->profile);
+    game->profile = NULL;
+}
+
+// The map file's name with its extension swapped for another, e.g. for its replay or profile
+void map_sibling_path(const struct game_map* map, char* path, size_t size, const char* extension) {
+    const char* name = map->name;
+    const char* dot = strrchr(name, '.');
+    int stem = dot != NULL ? (int)(dot - name) : (int)strlen(name);
+    snprintf(path, size, "%.*s%s", stem, name, extension);
+}
+
+/*
+    Snapshots
+
+    P saves the game and quits; --resume FILE picks it up again exactly where it was left. A
+    snapshot holds the whole state of a session in a few bytes per entity: the player, the
+    random generator, every entity and the noises still waiting to be heard. The map is not
+    copied, only its size and tile checksum are kept, and the map file is checked against them
+    when resuming. Binary maps are mapped into memory and their checksum comes from their
+    header, so resuming does not read or parse the tiles at all. The chase field and the
+    pathfinding cache start out empty and are filled again as they are needed; neither changes
+    where an entity goes (see "Chase field" and "Hierarchical pathfinding"), so a resumed game
+    plays out exactly like the one that was saved. --headless with --check-resume TURN checks
+    that.
+
+    The file (<map name>.catasave by default, or the file the game was resumed from) is first
+    written next to its final name and then renamed over it, so a crash while saving leaves the
+    previous snapshot intact.
+
+    Layout (version 1, little-endian, every field encoded byte by byte so snapshots move
+    between machines):
+        offset  size  field
+        0       8     magic, "CATASNP" followed by a NUL byte
+        8       4     format version
+        12      4     header size in bytes (offset of the entity arrays)
+        16      8     seed
+        24      8     checksum of the map tiles (see catamap_checksum)
+        32      4     map width
+        36      4     map height
+        40      4     entity count n
+        44      4     pending noise count m
+        48      32    random generator state, 4 x 8 bytes
+        80      4     player x
+        84      4     player y
+        88      4     player score
+        92      4     player heart rate
+        96      4     turns the player has stood still
+        100     1     player hidden
+        101     1     player moved this turn
+        102     2     reserved, 0
+        104     16n   entity x, y, target_x, target_y, 4 bytes each, one array after another
+        ...     8n    entity trips (struct hpa_trip): origin and goal tile, 4 bytes each
+        ...     3n    entity type, state, move_timer, 1 byte each, one array after another
+        ...     16m   pending noises: x, y, source, kind, 4 bytes each
+*/
+#define SNAPSHOT_MAGIC "CATASNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 104
+#define SNAPSHOT_NOISE_SIZE 16
+#define SNAPSHOT_CHUNK 1024 // values encoded per fwrite, or decoded per fread
+
+// Header in its on-disk layout
+static void snapshot_header_encode(const struct snapshot_header* header, unsigned char out[SNAPSHOT_HEADER_SIZE]) {
+    memset(out, 0, SNAPSHOT_HEADER_SIZE);
+    memcpy(out, header->magic, sizeof(header->magic));
+    catamap_put_le32(out + 8, header->version);
+    catamap_put_le32(out + 12, header->header_size);
+    catamap_put_le64(out + 16, header->seed);
+    catamap_put_le64(out + 24, header->map_checksum);
+    catamap_put_le32(out + 32, header->map_width);
+    catamap_put_le32(out + 36, header->map_height);
+    catamap_put_le32(out + 40, header->entity_count);
+    catamap_put_le32(out + 44, header->noise_count);
+    for (int i = 0; i < 4; i++) catamap_put_le64(out + 48 + 8 * i, header->rng[i]);
+    catamap_put_le32(out + 80, (uint32_t)header->player_x);
+    catamap_put_le32(out + 84, (uint32_t)header->player_y);
+    catamap_put_le32(out + 88, (uint32_t)header->player_score);
+    catamap_put_le32(out + 92, (uint32_t)header->player_heartrate);
+    catamap_put_le32(out + 96, (uint32_t)header->player_still_turns);
+    out[100] = header->player_hidden;
+    out[101] = header->player_moved;
+}
+
+static void snapshot_header_decode(const unsigned char in[SNAPSHOT_HEADER_SIZE], struct snapshot_header* header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, in, sizeof(header->magic));
+    header->version = catamap_get_le32(in + 8);
+    header->header_size = catamap_get_le32(in + 12);
+    header->seed = catamap_get_le64(in + 16);
+    header->map_checksum = catamap_get_le64(in + 24);
+    header->map_width = catamap_get_le32(in + 32);
+    header->map_height = catamap_get_le32(in + 36);
+    header->entity_count = catamap_get_le32(in + 40);
+    header->noise_count = catamap_get_le32(in + 44);
+    for (int i = 0; i < 4; i++) header->rng[i] = catamap_get_le64(in + 48 + 8 * i);
+    header->player_x = (int32_t)catamap_get_le32(in + 80);
+    header->player_y = (int32_t)catamap_get_le32(in + 84);
+    header->player_score = (int32_t)catamap_get_le32(in + 88);
+    header->player_heartrate = (int32_t)catamap_get_le32(in + 92);
+    header->player_still_turns = (int32_t)catamap_get_le32(in + 96);
+    header->player_hidden = in[100];
+    header->player_moved = in[101];
+}
+
+// Writes n values as 4-byte little-endian integers, 1 on failure
+static int snapshot_write_ints(FILE* file, const int* values, size_t n) {
+    unsigned char buffer[4 * SNAPSHOT_CHUNK];
+    for (size_t done = 0; done < n;) {
+        size_t count = n - done < SNAPSHOT_CHUNK ? n - done : SNAPSHOT_CHUNK;
+        for (size_t i = 0; i < count; i++) catamap_put_le32(buffer + 4 * i, (uint32_t)values[done + i]);
+        if (fwrite(buffer, 4, count, file) != count) return 1;
+        done += count;
+    }
+    return 0;
+}
+
+// Reads n 4-byte little-endian integers, 1 on failure
+static int snapshot_read_ints(FILE* file, int* values, size_t n) {
+    unsigned char buffer[4 * SNAPSHOT_CHUNK];
+    for (size_t done = 0; done < n;) {
+        size_t count = n - done < SNAPSHOT_CHUNK ? n - done : SNAPSHOT_CHUNK;
+        if (fread(buffer, 4, count, file) != count) return 1;
+        for (size_t i = 0; i < count; i++) values[done + i] = (int32_t)catamap_get_le32(buffer + 4 * i);
+        done += count;
+    }
+    return 0;
+}
+
+// Writes n trips, origin then goal, 1 on failure
+static int snapshot_write_trips(FILE* file, const struct hpa_trip* trips, size_t n) {
+    unsigned char buffer[8 * SNAPSHOT_CHUNK];
+    for (size_t done = 0; done < n;) {
+        size_t count = n - done < SNAPSHOT_CHUNK ? n - done : SNAPSHOT_CHUNK;
+        for (size_t i = 0; i < count; i++) {
+            catamap_put_le32(buffer + 8 * i, (uint32_t)trips[done + i].origin);
+            catamap_put_le32(buffer + 8 * i + 4, (uint32_t)trips[done + i].goal);
+        }
+        if (fwrite(buffer, 8, count, file) != count) return 1;
+        done += count;
+    }
+    return 0;
+}
+
+// Reads n trips, 1 on failure
+static int snapshot_read_trips(FILE* file, struct hpa_trip* trips, size_t n) {
+    unsigned char buffer[8 * SNAPSHOT_CHUNK];
+    for (size_t done = 0; done < n;) {
+        size_t count = n - done < SNAPSHOT_CHUNK ? n - done : SNAPSHOT_CHUNK;
+        if (fread(buffer, 8, count, file) != count) return 1;
+        for (size_t i = 0; i < count; i++) {
+            trips[done + i].origin = (int32_t)catamap_get_le32(buffer + 8 * i);
+            trips[done + i].goal = (int32_t)catamap_get_le32(buffer + 8 * i + 4);
+        }
+        done += count;
+    }
+    return 0;
+}
+
+/*
+    Writes the game state to an open file.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static int snapshot_write(const struct game_session* game, FILE* file) {
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = SNAPSHOT_HEADER_SIZE;
+    header.seed = game->seed;
+    header.map_checksum = game->map->checksum;
+    header.map_width = (uint32_t)game->map->width;
+    header.map_height = (uint32_t)game->map->height;
+    header.entity_count = (uint32_t)game->entities.count;
+    header.noise_count = (uint32_t)game->noise_count;
+    memcpy(header.rng, game->rng.s, sizeof(header.rng));
+    header.player_x = game->player_x;
+    header.player_y = game->player_y;
+    header.player_score = game->player_score;
+    header.player_heartrate = game->player_heartrate;
+    header.player_still_turns = game->player_still_turns;
+    header.player_hidden = (uint8_t)game->player_hidden;
+    header.player_moved = (uint8_t)game->player_moved;
+
+    size_t n = (size_t)game->entities.count;
+    unsigned char encoded[SNAPSHOT_HEADER_SIZE];
+    snapshot_header_encode(&header, encoded);
+    int failed = fwrite(encoded, sizeof(encoded), 1, file) != 1;
+    int* const ints[] = {game->entities.x, game->entities.y, game->entities.target_x, game->entities.target_y};
+    for (int a = 0; a < 4 && !failed; a++) {
+        failed = snapshot_write_ints(file, ints[a], n);
+    }
+    if (!failed) {
+        failed = snapshot_write_trips(file, game->entities.trip, n);
+    }
+    unsigned char* const bytes[] = {game->entities.type, game->entities.state, game->entities.move_timer};
+    for (int a = 0; a < 3 && !failed && n > 0; a++) {
+        failed = fwrite(bytes[a], 1, n, file) != n;
+    }
+    for (int i = 0; i < game->noise_count && !failed; i++) {
+        unsigned char noise[SNAPSHOT_NOISE_SIZE];
+        catamap_put_le32(noise, (uint32_t)game->noises[i].x);
+        catamap_put_le32(noise + 4, (uint32_t)game->noises[i].y);
+        catamap_put_le32(noise + 8, (uint32_t)game->noises[i].source);
+        catamap_put_le32(noise + 12, game->noises[i].kind);
+        failed = fwrite(noise, sizeof(noise), 1, file) != 1;
+    }
+    if (fflush(file) != 0) failed = 1;
+    return failed;
+}
+
+/*
+    Writes the game state to filename, atomically.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int snapshot_save(const struct game_session* game, const char* filename) {
+    char temporary[512];
+    if ((size_t)snprintf(temporary, sizeof(temporary), "%s.tmp", filename) >= sizeof(temporary)) {
+        return 1;
+    }
+    FILE* file = fopen(temporary, "wb");
+    if (file == NULL) {
+        return 1;
+    }
+    int failed = snapshot_write(game, file);
+#ifndef _WIN32
+    if (!failed && fsync(fileno(file)) != 0) failed = 1;
+#endif
+    if (fclose(file) != 0) failed = 1;
+#ifdef _WIN32
+    remove(filename); // rename does not replace files on Windows
+#endif
+    if (failed || rename(temporary, filename) != 0) {
+        remove(temporary);
+        return 1;
+    }
+    return 0;
+}
+
+// Reads a snapshot header and moves to the entity arrays, NULL on success or what is wrong
+static const char* snapshot_read_header(FILE* file, struct snapshot_header* header) {
+    const char* error = NULL;
+    unsigned char encoded[SNAPSHOT_HEADER_SIZE];
+    if (fread(encoded, sizeof(encoded), 1, file) != 1) {
+        return "truncated header";
+    }
+    snapshot_header_decode(encoded, header);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        error = "not a snapshot";
+    } else if (header->version != SNAPSHOT_VERSION) {
+        error = "unsupported snapshot version";
+    } else if (header->header_size < SNAPSHOT_HEADER_SIZE || header->entity_count > INT32_MAX ||
+               header->noise_count > SOUND_POOL_SIZE || fseek(file, (long)header->header_size, SEEK_SET) != 0) {
+        error = "invalid header";
+    }
+    return error;
+}
+
+/*
+    Opens a snapshot and reads its header, leaving the file at the entity arrays.
+
+    Returns:
+        the open file
+        NULL on failure (message printed to stderr)
+*/
+FILE* snapshot_open(const char* filename, struct snapshot_header* header) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror("Error opening snapshot file");
+        return NULL;
+    }
+    const char* error = snapshot_read_header(file, header);
+    if (error) {
+        fprintf(stderr, "Invalid snapshot file %s: %s\n", filename, error);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+
+/*
+    Checks that a snapshot was saved on the given map.
+
+    Returns:
+        0 if it was
+        1 if not (message printed to stderr)
+*/
+int snapshot_check_map(const struct game_map* map, const struct snapshot_header* header) {
+    if (header->map_width != (uint32_t)map->width || header->map_height != (uint32_t)map->height ||
+        header->map_checksum != map->checksum) {
+        fprintf(stderr, "The snapshot was saved on a different map\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Puts the game set up by initialize_game (on the snapshot's map, with its entity count) back
+    into the state the snapshot was taken in.
+
+    Returns:
+        0 on success
+        1 if the snapshot is damaged (message printed to stderr)
+*/
+int snapshot_restore(struct game_session* game, FILE* file, const struct snapshot_header* header) {
+    size_t n = (size_t)game->entities.count;
+    int failed = header->entity_count != (uint32_t)game->entities.count;
+    int* const ints[] = {game->entities.x, game->entities.y, game->entities.target_x, game->entities.target_y};
+    for (int a = 0; a < 4 && !failed; a++) {
+        failed = snapshot_read_ints(file, ints[a], n);
+    }
+    if (!failed) {
+        failed = snapshot_read_trips(file, game->entities.trip, n);
+    }
+    unsigned char* const bytes[] = {game->entities.type, game->entities.state, game->entities.move_timer};
+    for (int a = 0; a < 3 && !failed && n > 0; a++) {
+        failed = fread(bytes[a], 1, n, file) != n;
+    }
+    clear_noises(game);
+    for (uint32_t i = 0; i < header->noise_count && !failed; i++) {
+        unsigned char noise[SNAPSHOT_NOISE_SIZE];
+        failed = fread(noise, sizeof(noise), 1, file) != 1;
+        if (failed) break;
+        uint32_t kind = catamap_get_le32(noise + 12);
+        failed = kind >= NOISE_KINDS || emit_noise(game, (int32_t)catamap_get_le32(noise), (int32_t)catamap_get_le32(noise + 4),
+                                                   (int)kind, (int32_t)catamap_get_le32(noise + 8)) != 0;
+    }
+    int32_t tiles = game->map->width * game->map->height;
+    for (size_t i = 0; i < n && !failed; i++) {
+        const struct hpa_trip* trip = &game->entities.trip[i];
+        failed = game->entities.x[i] < 0 || game->entities.x[i] >= game->map->width || game->entities.y[i] < 0 ||
+                 game->entities.y[i] >= game->map->height || game->entities.type[i] >= ENTITY_TYPES ||
+                 trip->origin < 0 || trip->origin >= tiles || trip->goal < 0 || trip->goal >= tiles;
+    }
+    if (failed || header->player_x < 0 || header->player_x >= game->map->width || header->player_y < 0 ||
+        header->player_y >= game->map->height) {
+        fprintf(stderr, "The snapshot is damaged\n");
+        return 1;
+    }
+    entity_grid_rebuild(&game->entities);
+
+    memcpy(game->rng.s, header->rng, sizeof(header->rng));
+    game->player_x = header->player_x;
+    game->player_y = header->player_y;
+    game->player_score = header->player_score;
+    game->player_heartrate = header->player_heartrate;
+    game->player_still_turns = header->player_still_turns;
+    game->player_hidden = (char)header->player_hidden;
+    game->player_moved = header->player_moved;
+    fprintf(game->out, "Resumed at turn %d, player at (%d, %d)\n", game->player_score, game->player_x, game->player_y);
+    return 0;
+}
+
+/*
+    Saves the game into a temporary snapshot and resumes it as a second game on the same map,
+    as --resume would. Used by --check-resume.
+
+    Returns:
+        the resumed game, to be freed with free_game and free
+        NULL on failure
+*/
+struct game_session* snapshot_fork(const struct game_session* game) {
+    FILE* file = tmpfile();
+    if (file == NULL) {
+        return NULL;
+    }
+    struct snapshot_header header;
+    struct game_session* copy = NULL;
+    if (snapshot_write(game, file) == 0 && fseek(file, 0, SEEK_SET) == 0 &&
+        snapshot_read_header(file, &header) == NULL) {
+        copy = malloc(sizeof(*copy));
+        if (copy != NULL && initialize_game(copy, game->map, game->hpa.scratch, header.seed, (int)header.entity_count) != 0) {
+            free(copy);
+            copy = NULL;
+        }
+    }
+    if (copy != NULL) {
+        copy->headless = game->headless;
+        if (snapshot_restore(copy, file, &header) != 0) {
+            free_game(copy);
+            free(copy);
+            copy = NULL;
+        }
+    }
+    fclose(file);
+    return copy;
+}
 
-    printf("Player Position: (%d, %d) | Turn: %d\n", player_x, player_y, player_score);
+// 1 if two games are in the same state, everything a snapshot holds compared
+int snapshot_matches(const struct game_session* a, const struct game_session* b) {
+    if (memcmp(a->rng.s, b->rng.s, sizeof(a->rng.s)) != 0 || a->player_x != b->player_x || a->player_y != b->player_y ||
+        a->player_score != b->player_score || a->player_heartrate != b->player_heartrate ||
+        a->player_hidden != b->player_hidden || a->player_moved != b->player_moved ||
+        a->player_still_turns != b->player_still_turns || a->entities.count != b->entities.count ||
+        a->noise_count != b->noise_count) {
+        return 0;
+    }
+    size_t n = (size_t)a->entities.count;
+    if (n > 0 && (memcmp(a->entities.x, b->entities.x, n * sizeof(int)) != 0 ||
+                  memcmp(a->entities.y, b->entities.y, n * sizeof(int)) != 0 ||
+                  memcmp(a->entities.target_x, b->entities.target_x, n * sizeof(int)) != 0 ||
+                  memcmp(a->entities.target_y, b->entities.target_y, n * sizeof(int)) != 0 ||
+                  memcmp(a->entities.trip, b->entities.trip, n * sizeof(struct hpa_trip)) != 0 ||
+                  memcmp(a->entities.type, b->entities.type, n) != 0 ||
+                  memcmp(a->entities.state, b->entities.state, n) != 0 ||
+                  memcmp(a->entities.move_timer, b->entities.move_timer, n) != 0)) {
+        return 0;
+    }
+    for (int i = 0; i < a->noise_count; i++) {
+        const struct noise* x = &a->noises[i];
+        const struct noise* y = &b->noises[i];
+        if (x->x != y->x || x->y != y->y || x->source != y->source || x->kind != y->kind) return 0;
+    }
+    return 1;
 }
 
-void cleanup_game() {
-    // Cleanup resources and perform any necessary shutdown procedures
-    printf("Cleaning up game resources...\n");
-    // Print final map for verification
+/*
+    Scoreboard
 
-    // printf("Final Map State:\n");
-    // for (int y = 0; y < map_height; y++) {
-    //     for (int x = 0; x < map_width; x++) {
-    //         printf("%d ", map_dyn[y][x]);
-    //     }
-    //     printf("\n");
-    // }
+    Each map keeps its scores in <map name>.catascore, a binary store that every finished game
+    adds to. Reading the best scores never depends on how many games were played.
+
+    Layout (version 1, little-endian):
+        offset        size     field
+        0             8        magic, "CATASCR" followed by a NUL byte
+        8             4        format version
+        12            4        header size in bytes (offset of the top scores)
+        16            8        number of games recorded
+        24            4        number of top scores kept
+        28            4        room for top scores (SCORE_TOP_K)
+        32            24 * K   top scores, best first, ties in the order they were played
+        32 + 24 * K   24 * n   every game, in the order they were played
+
+    A record holds the time the game ended (8 bytes, seconds since the epoch), its seed (8), the
+    score (4) and the entity count (4). Headers and records are encoded field by field, so a
+    scoreboard shared between machines reads the same on all of them.
+
+    Adding a game appends its record and puts it into the top scores with a binary search, so
+    only the header, the top scores and one record are read and written. The file is
+    locked (flock) while it is read or changed, so games finishing at once do not lose scores;
+    on Windows there is no locking.
+
+    Older scoreboards were text logs, one "Score: N" line per game. They are taken over into
+    the binary store the first time a game ends on their map, without dates or seeds.
+*/
+#define SCORE_MAGIC "CATASCR"
+#define SCORE_VERSION 1
+#define SCORE_SHOWN 10 // top scores printed when a game ends
+#define SCORE_HEADER_SIZE 32
+#define SCORE_RECORD_SIZE 24 // timestamp 8, seed 8, score 4, entity count 4
+#define SCORE_CHUNK 64 // records encoded per fwrite, or decoded per fread
+
+#define SCORE_TOP_OFFSET(header) ((long)(header)->header_size)
+#define SCORE_RECORD_OFFSET(header, index) \
+    ((long)(header)->header_size + (long)SCORE_RECORD_SIZE * ((long)(header)->top_capacity + (long)(index)))
+
+// Header in its on-disk layout, little-endian like every other field of the file
+static void score_header_encode(const struct score_header* header, unsigned char out[SCORE_HEADER_SIZE]) {
+    memcpy(out, header->magic, sizeof(header->magic));
+    catamap_put_le32(out + 8, header->version);
+    catamap_put_le32(out + 12, header->header_size);
+    catamap_put_le64(out + 16, header->record_count);
+    catamap_put_le32(out + 24, header->top_count);
+    catamap_put_le32(out + 28, header->top_capacity);
+}
+
+static void score_header_decode(const unsigned char in[SCORE_HEADER_SIZE], struct score_header* header) {
+    memcpy(header->magic, in, sizeof(header->magic));
+    header->version = catamap_get_le32(in + 8);
+    header->header_size = catamap_get_le32(in + 12);
+    header->record_count = catamap_get_le64(in + 16);
+    header->top_count = catamap_get_le32(in + 24);
+    header->top_capacity = catamap_get_le32(in + 28);
+}
+
+// Writes n records, 1 on failure
+static int score_records_write(FILE* file, const struct score_record* records, size_t n) {
+    unsigned char buffer[SCORE_RECORD_SIZE * SCORE_CHUNK];
+    for (size_t done = 0; done < n;) {
+        size_t count = n - done < SCORE_CHUNK ? n - done : SCORE_CHUNK;
+        for (size_t i = 0; i < count; i++) {
+            const struct score_record* record = &records[done + i];
+            unsigned char* out = buffer + SCORE_RECORD_SIZE * i;
+            catamap_put_le64(out, (uint64_t)record->timestamp);
+            catamap_put_le64(out + 8, record->seed);
+            catamap_put_le32(out + 16, (uint32_t)record->score);
+            catamap_put_le32(out + 20, record->entities);
+        }
+        if (fwrite(buffer, SCORE_RECORD_SIZE, count, file) != count) return 1;
+        done += count;
+    }
+    return 0;
+}
+
+// Reads n records, 1 on failure
+static int score_records_read(FILE* file, struct score_record* records, size_t n) {
+    unsigned char buffer[SCORE_RECORD_SIZE * SCORE_CHUNK];
+    for (size_t done = 0; done < n;) {
+        size_t count = n - done < SCORE_CHUNK ? n - done : SCORE_CHUNK;
+        if (fread(buffer, SCORE_RECORD_SIZE, count, file) != count) return 1;
+        for (size_t i = 0; i < count; i++) {
+            struct score_record* record = &records[done + i];
+            const unsigned char* in = buffer + SCORE_RECORD_SIZE * i;
+            record->timestamp = (int64_t)catamap_get_le64(in);
+            record->seed = catamap_get_le64(in + 8);
+            record->score = (int32_t)catamap_get_le32(in + 16);
+            record->entities = catamap_get_le32(in + 20);
+        }
+        done += count;
+    }
+    return 0;
+}
+
+/*
+    Opens a map's scoreboard and locks it, exclusively for writing or shared for reading.
+
+    Returns:
+        the open file
+        NULL on failure, or when reading a scoreboard that does not exist
+*/
+static FILE* scoreboard_open(const char* filename, int write) {
+#ifndef _WIN32
+    int fd = open(filename, write ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) return NULL;
+    if (flock(fd, write ? LOCK_EX : LOCK_SH) != 0) {
+        close(fd);
+        return NULL;
+    }
+    FILE* file = fdopen(fd, write ? "r+b" : "rb");
+    if (file == NULL) close(fd);
+    return file;
+#else
+    FILE* file = fopen(filename, write ? "r+b" : "rb");
+    if (file == NULL && write) file = fopen(filename, "w+b");
+    return file;
+#endif
+}
+
+// Flushes and closes a scoreboard, which drops its lock
+static int scoreboard_close(FILE* file) {
+    return fclose(file) != 0;
+}
+
+/*
+    Reads a scoreboard's header.
 
-    // Free dynamically allocated memory for the map
-    for (int i = 0; i < map_height; i++) { //by row
-        // Free each row
-        free(map_dyn[i]);
-        // printf("Freed row %d\n", i+1); // Debugging line
+    Returns:
+        0 on success
+        1 if the file is empty
+        2 if it is an older text scoreboard
+        3 if it is damaged or of an unknown version
+*/
+static int scoreboard_read_header(FILE* file, struct score_header* header) {
+    unsigned char encoded[SCORE_HEADER_SIZE] = {0};
+    if (fseek(file, 0, SEEK_SET) != 0) return 3;
+    size_t got = fread(encoded, 1, sizeof(encoded), file);
+    score_header_decode(encoded, header);
+    if (got == 0) return 1;
+    if (got < sizeof(SCORE_MAGIC) || memcmp(header->magic, SCORE_MAGIC, sizeof(SCORE_MAGIC)) != 0) return 2;
+    if (got < sizeof(encoded) || header->version != SCORE_VERSION || header->header_size < SCORE_HEADER_SIZE ||
+        header->top_capacity == 0 || header->top_capacity > SCORE_TOP_K || header->top_count > header->top_capacity) {
+        return 3;
     }
+    return 0;
+}
+
+static void scoreboard_new_header(struct score_header* header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SCORE_MAGIC, sizeof(SCORE_MAGIC));
+    header->version = SCORE_VERSION;
+    header->header_size = SCORE_HEADER_SIZE;
+    header->top_capacity = SCORE_TOP_K;
+}
 
-    // Free entity positions
-    for (int i = 0; i < 3; i++) {
-        free(entity_positions[i]);
+/*
+    Puts a record into the top scores, best first, after any equal scores.
+
+    Returns:
+        its place (0 = best)
+        -1 if it does not make it into the top scores
+*/
+static int score_top_insert(struct score_record* top, uint32_t* count, uint32_t capacity, const struct score_record* record) {
+    uint32_t low = 0, high = *count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (top[middle].score >= record->score) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
     }
+    if (low >= capacity) return -1;
+    uint32_t kept = *count < capacity ? *count : capacity - 1;
+    memmove(&top[low + 1], &top[low], sizeof(*top) * (kept - low));
+    top[low] = *record;
+    if (*count < capacity) (*count)++;
+    return (int)low;
+}
 
-    free(map_dyn);
+// Writes the header and the top scores
+static int scoreboard_write_top(FILE* file, const struct score_header* header, const struct score_record* top) {
+    unsigned char encoded[SCORE_HEADER_SIZE];
+    score_header_encode(header, encoded);
+    return fseek(file, 0, SEEK_SET) != 0 || fwrite(encoded, sizeof(encoded), 1, file) != 1 ||
+           fseek(file, SCORE_TOP_OFFSET(header), SEEK_SET) != 0 ||
+           score_records_write(file, top, header->top_capacity);
 }
 
-void save_scoreboard(const char* map_name, int score) {
-    // Implementation for saving scoreboard to file goes here
-    char filename[256];
-    // remove the extension from map_name for the scoreboard filename array
-    const char* dot = strrchr(map_name, '.');
-    // remove the .catamap extension from map_name for the scoreboard filename array
-    snprintf(filename, sizeof(filename), "%.*s.catascore", (int)(dot - map_name), map_name);
+/*
+    Replaces an older text scoreboard with a binary one holding the same scores. Records are
+    only ever written past the top scores, so the new layout can be written over the text.
 
-    FILE* file = fopen(filename, "a");
-    if (!file) {
+    Returns:
+        0 on success
+        1 on failure
+*/
+static int scoreboard_import_text(FILE* file, struct score_header* header, struct score_record* top) {
+    size_t capacity = 64, count = 0;
+    struct score_record* records = malloc(sizeof(*records) * capacity);
+    if (records == NULL) return 1;
+    char line[256];
+    fseek(file, 0, SEEK_SET);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        int score;
+        if (sscanf(line, "Score: %d", &score) != 1) continue;
+        if (count == capacity) {
+            capacity *= 2;
+            struct score_record* grown = realloc(records, sizeof(*records) * capacity);
+            if (grown == NULL) {
+                free(records);
+                return 1;
+            }
+            records = grown;
+        }
+        memset(&records[count], 0, sizeof(records[count]));
+        records[count++].score = score; // the old log has no real date or seed
+    }
+
+    scoreboard_new_header(header);
+    memset(top, 0, sizeof(*top) * SCORE_TOP_K);
+    for (size_t i = 0; i < count; i++) {
+        score_top_insert(top, &header->top_count, header->top_capacity, &records[i]);
+    }
+    header->record_count = count;
+    int failed = scoreboard_write_top(file, header, top) ||
+                 (count > 0 && (fseek(file, SCORE_RECORD_OFFSET(header, 0), SEEK_SET) != 0 ||
+                                score_records_write(file, records, count)));
+    free(records);
+    return failed;
+}
+
+/*
+    Records a finished game on its map's scoreboard and shows the game the best scores.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int save_scoreboard(struct game_session* game) {
+    char filename[256];
+    map_sibling_path(game->map, filename, sizeof(filename), ".catascore");
+    FILE* file = scoreboard_open(filename, 1);
+    if (file == NULL) {
         perror("Error opening scoreboard file");
-        return;
+        return 1;
     }
 
-    fprintf(file, "Score: %d \t Date: %s\n", score, __DATE__);
-    fclose(file);
+    struct score_header header;
+    struct score_record top[SCORE_TOP_K];
+    memset(top, 0, sizeof(top));
+    int status = scoreboard_read_header(file, &header);
+    if (status == 1) {
+        scoreboard_new_header(&header);
+        status = 0;
+    } else if (status == 2) {
+        status = scoreboard_import_text(file, &header, top);
+    } else if (status == 0) {
+        if (fseek(file, SCORE_TOP_OFFSET(&header), SEEK_SET) != 0 ||
+            score_records_read(file, top, header.top_count)) {
+            status = 3;
+        }
+    }
+    if (status == 3) {
+        fprintf(stderr, "Scoreboard file %s is damaged, the score was not saved\n", filename);
+        scoreboard_close(file);
+        return 1;
+    }
+
+    struct score_record record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp = (int64_t)time(NULL);
+    record.seed = game->seed;
+    record.score = game->player_score;
+    record.entities = (uint32_t)game->entities.count;
+    int place = score_top_insert(top, &header.top_count, header.top_capacity, &record);
+    int failed = status != 0 ||
+                 fseek(file, SCORE_RECORD_OFFSET(&header, header.record_count), SEEK_SET) != 0 ||
+                 score_records_write(file, &record, 1);
+    if (!failed) {
+        header.record_count++;
+        failed = scoreboard_write_top(file, &header, top);
+    }
+    if (scoreboard_close(file) != 0) failed = 1;
+    if (failed) {
+        perror("Error writing scoreboard file");
+        return 1;
+    }
+
+    if (place >= 0) {
+        fprintf(game->out, "Your score of %d is #%d on this map!\n", game->player_score, place + 1);
+    }
+    print_scoreboard(game->map, game->out, SCORE_SHOWN);
+    return 0;
+}
+
+/*
+    Prints the best scores on a map to out, up to count of them. Only the header and those
+    scores are read.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+int print_scoreboard(const struct game_map* map, FILE* out, int count) {
+    char filename[256];
+    map_sibling_path(map, filename, sizeof(filename), ".catascore");
+    FILE* file = scoreboard_open(filename, 0);
+    if (file == NULL) {
+        fprintf(out, "No scores on this map yet.\n");
+        return 0;
+    }
+    struct score_header header;
+    struct score_record top[SCORE_TOP_K];
+    int status = scoreboard_read_header(file, &header);
+    if (count > (int)header.top_count) count = (int)header.top_count;
+    if (status != 0 || (count > 0 && (fseek(file, SCORE_TOP_OFFSET(&header), SEEK_SET) != 0 ||
+                                      score_records_read(file, top, (size_t)count)))) {
+        scoreboard_close(file);
+        if (status == 2) {
+            fprintf(out, "This map's scoreboard is still a text log, it is converted when the next game ends.\n");
+            return 0;
+        }
+        fprintf(stderr, "Scoreboard file %s is damaged\n", filename);
+        return 1;
+    }
+    scoreboard_close(file);
+
+    fprintf(out, "Best scores (%llu games played):\n", (unsigned long long)header.record_count);
+    for (int i = 0; i < count; i++) {
+        char date[32] = "unknown date";
+        time_t when = (time_t)top[i].timestamp;
+        struct tm local;
+#ifndef _WIN32
+        int dated = top[i].timestamp > 0 && localtime_r(&when, &local) != NULL;
+#else
+        int dated = top[i].timestamp > 0 && localtime_s(&local, &when) == 0;
+#endif
+        if (dated) strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &local);
+        fprintf(out, "%3d. %6d turns  %s  seed %llu  %u entities\n", i + 1, top[i].score, date,
+               (unsigned long long)top[i].seed, top[i].entities);
+    }
+    return 0;
 }
 
 // UTILITY FUNCTIONS
-int seed_count = 0; // Seed count to ensure different seeds on rapid calls
-// Gets a random number within the given range:
-int random_number_range(int min, int max) {
-    //srand((unsigned int)time(NULL) + seed_count++); // Seed the random number generator
-    return (rand() % (max - min + 1)) + min;
-}
-// returns either 0 (false) or 1 (true)
-int random_bool() {
-    return random_number_range(0,1);
-}
-// Line of sight function using Bresenham's line algorithm
-int is_line_of_sight(int map[21][21], int x1, int y1, int x2, int y2) {
-    if (x1 == x2 && y1 == y2) return 1;
-    int dx = abs(x2 - x1);
-    int dy = abs(y2 - y1);
-    int sx = x1 < x2 ? 1 : -1;
-    int sy = y1 < y2 ? 1 : -1;
-    int err = dx - dy;
-    int x = x1, y = y1;
-    while (1) {
-        if (x != x1 || y != y1) {
-            // Check for diagonal blocking: if moving diagonally and both adjacent orthogonal cells are walls, block LOS
-            // Checks for both tiles labeled as walls (1) and hiding spots (2) as blocking LOS
-            if (sx != 0 && sy != 0) {
-                int adj_x = x + sx;
-                int adj_y = y + sy;
-                // Ensure adjacents are within bounds
-                if (adj_x >= 0 && adj_x < 21 && adj_y >= 0 && adj_y < 21) {
-                    if (map[adj_y][x] == 1 && map[y][adj_x] == 1) return 0;
-                    if (map[adj_y][x] == 2 && map[y][adj_x] == 2) return 0;
+/*
+    Ray tables
+
+    The Bresenham line walked by is_line_of_sight only depends on the offset between origin and
+    target, so the steps of every line that fits in the view window are worked out once by
+    init_ray_tables instead of on every call. Each step is a cell offset from the origin.
+
+    Lines from the centered origin (VIEW_RADIUS, VIEW_RADIUS), which is where the player is
+    everywhere except near the map borders, get a second table that holds each line as row
+    masks of the window, so a query is a handful of mask tests against the window's blockers.
+    Origins clamped off-center by render_game walk the offset table step by step.
+
+    C cannot build these tables at compile time, so they are filled on first use.
+*/
+#define RAY_SPAN (2 * VIEW_SIZE - 1) // offsets from -(VIEW_SIZE - 1) to VIEW_SIZE - 1
+
+struct ray {
+    unsigned char length; // steps, not counting the origin, the last step is the target
+    signed char dx[VIEW_SIZE - 1];
+    signed char dy[VIEW_SIZE - 1];
+};
+
+struct centered_ray {
+    unsigned char first_row;
+    unsigned char rows;
+    view_row mask[VIEW_RADIUS + 1]; // steps in rows first_row onward
+};
+
+static struct ray ray_table[RAY_SPAN][RAY_SPAN]; // indexed by [dy + VIEW_SIZE - 1][dx + VIEW_SIZE - 1]
+static struct centered_ray centered_rays[VIEW_SIZE][VIEW_SIZE]; // indexed by target [y][x]
+static int ray_tables_ready = 0;
+
+// Index into view_window.blocks for a line with step signs (sx, sy)
+#define RAY_QUADRANT(sx, sy) (((sx) > 0) | ((sy) > 0) << 1)
+
+void init_ray_tables() {
+    if (ray_tables_ready) return;
+    for (int ty = 0; ty < RAY_SPAN; ty++) {
+        for (int tx = 0; tx < RAY_SPAN; tx++) {
+            // Bresenham's line algorithm from (0, 0) to the offset
+            int x2 = tx - (VIEW_SIZE - 1), y2 = ty - (VIEW_SIZE - 1);
+            int dx = abs(x2), dy = abs(y2);
+            int sx = 0 < x2 ? 1 : -1;
+            int sy = 0 < y2 ? 1 : -1;
+            int err = dx - dy;
+            int x = 0, y = 0;
+            struct ray* ray = &ray_table[ty][tx];
+            ray->length = 0;
+            while (x != x2 || y != y2) {
+                int e2 = 2 * err;
+                if (e2 > -dy) {
+                    err -= dy;
+                    x += sx;
                 }
-                // Also check the previous step's adjacent cells
-                int prev_x = x - sx;
-                int prev_y = y - sy;
-                if (prev_x >= 0 && prev_x < 21 && prev_y >= 0 && prev_y < 21) {
-                    if (map[prev_y][x] == 1 && map[y][prev_x] == 1) return 0;
-                    if (map[prev_y][x] == 2 && map[y][prev_x] == 2) return 0;
+                if (e2 < dx) {
+                    err += dx;
+                    y += sy;
                 }
+                ray->dx[ray->length] = (signed char)x;
+                ray->dy[ray->length] = (signed char)y;
+                ray->length++;
+            }
+        }
+    }
+    for (int y2 = 0; y2 < VIEW_SIZE; y2++) {
+        for (int x2 = 0; x2 < VIEW_SIZE; x2++) {
+            int dy = y2 - VIEW_RADIUS;
+            const struct ray* ray = &ray_table[dy + VIEW_SIZE - 1][x2 - VIEW_RADIUS + VIEW_SIZE - 1];
+            struct centered_ray* centered = &centered_rays[y2][x2];
+            memset(centered, 0, sizeof(*centered));
+            centered->first_row = (unsigned char)(dy < 0 ? y2 : VIEW_RADIUS);
+            centered->rows = (unsigned char)(abs(dy) + 1);
+            for (int i = 0; i < ray->length; i++) {
+                int x = VIEW_RADIUS + ray->dx[i], y = VIEW_RADIUS + ray->dy[i];
+                centered->mask[y - centered->first_row] |= (view_row)1 << x;
             }
-            if (map[y][x] == 1) return 0;
         }
-        if (x == x2 && y == y2) break;
-        int e2 = 2 * err;
-        if (e2 > -dy) {
-            err -= dy;
-            x += sx;
+    }
+    ray_tables_ready = 1;
+}
+
+// Row y shifted so that bit x holds column x + dx, zero past the window edges
+static view_row view_shift(view_row row, int dx) {
+    return dx > 0 ? row >> dx : (row << -dx) & VIEW_ROW_MASK;
+}
+
+/*
+    Fills view->blocks from the tile masks. A line of sight stops at a cell that is a wall, or
+    where the line squeezes diagonally between two walls or two hiding spots, toward either
+    neighbouring step. For a line with step signs (sx, sy), those are the pairs at
+    (x, y + sy) / (x + sx, y) and (x, y - sy) / (x - sx, y). Pairs reaching outside the window
+    do not count, like the bounds checks of the original Bresenham walk.
+*/
+void build_view_blockers(struct view_window* view) {
+    for (int quadrant = 0; quadrant < 4; quadrant++) {
+        int sx = (quadrant & 1) ? 1 : -1;
+        int sy = (quadrant & 2) ? 1 : -1;
+        for (int y = 0; y < VIEW_SIZE; y++) {
+            view_row blocks = view->wall[y];
+            int ahead = y + sy, behind = y - sy;
+            if (ahead >= 0 && ahead < VIEW_SIZE) {
+                blocks |= view->wall[ahead] & view_shift(view->wall[y], sx);
+                blocks |= view->hiding[ahead] & view_shift(view->hiding[y], sx);
+            }
+            if (behind >= 0 && behind < VIEW_SIZE) {
+                blocks |= view->wall[behind] & view_shift(view->wall[y], -sx);
+                blocks |= view->hiding[behind] & view_shift(view->hiding[y], -sx);
+            }
+            view->blocks[quadrant][y] = blocks;
         }
-        if (e2 < dx) {
-            err += dx;
-            y += sy;
+    }
+}
+
+// Line of sight function using Bresenham's line algorithm, walked from the ray tables
+int is_line_of_sight(const struct view_window* view, int x1, int y1, int x2, int y2) {
+    if (x1 == x2 && y1 == y2) return 1;
+    if (!ray_tables_ready) init_ray_tables();
+    const view_row* blocks = view->blocks[RAY_QUADRANT(x1 < x2 ? 1 : -1, y1 < y2 ? 1 : -1)];
+    if (x1 == VIEW_RADIUS && y1 == VIEW_RADIUS) {
+        // Centered origin: test whole rows of the line at once
+        const struct centered_ray* ray = &centered_rays[y2][x2];
+        view_row hit = 0;
+        for (int i = 0; i < ray->rows; i++) {
+            hit |= ray->mask[i] & blocks[ray->first_row + i];
         }
+        return hit == 0;
+    }
+    const struct ray* ray = &ray_table[y2 - y1 + VIEW_SIZE - 1][x2 - x1 + VIEW_SIZE - 1];
+    for (int i = 0; i < ray->length; i++) {
+        int x = x1 + ray->dx[i], y = y1 + ray->dy[i];
+        if (blocks[y] >> x & 1) return 0;
     }
     return 1;
 }
 
-void line_of_sight(int map[21][21], int visibility[21][21], int origin_x, int origin_y) {
-    memset(visibility, 0, sizeof(int) * 21 * 21);
-    int cx = origin_x, cy = origin_y;
-    int direct_los[21][21] = {0};
-    for (int y = 0; y < 21; y++) {
-        for (int x = 0; x < 21; x++) {
-            int dx = x - cx;
-            int dy = y - cy;
-            int dist = abs(dx) + abs(dy);
-            if (dist > 10) continue;
-            if (is_line_of_sight(map, cx, cy, x, y) && map[y][x] == 0) {
-                visibility[y][x] = 1;
-                direct_los[y][x] = 1;
-            }
-        }
-    }
-    // Reveal walls adjacent to revealed floors
-    for (int y = 0; y < 21; y++) {
-        for (int x = 0; x < 21; x++) {
-            if (visibility[y][x] == 1 && map[y][x] == 0) {
-                for (int dy = -1; dy <= 1; dy++) {
-                    for (int dx = -1; dx <= 1; dx++) {
-                        if (dx == 0 && dy == 0) continue;
-                        int nx = x + dx, ny = y + dy;
-                        if (nx >= 0 && nx < 21 && ny >= 0 && ny < 21 && map[ny][nx] == 1) {
-                            visibility[ny][nx] = 1;
-                        }
-                    }
-                }
+/*
+    Field of view engine
+
+    Computes which cells are in direct line of sight from an origin, by the same rules as
+    is_line_of_sight, but visiting every cell within the radius once instead of walking one
+    Bresenham line per cell.
+
+    is_line_of_sight walks from the origin to the target (dx, dy) and fails on the first step
+    cell that blocks it (see build_view_blockers). Within a quadrant the step signs are fixed,
+    so whether a cell blocks does not depend on the target. Along the major axis the line is
+    at minor offset ceil(k * m - 1/2) after k steps, where m is the target's slope (minor /
+    major, 0 to 1). A blocking cell at (k, j) therefore blocks exactly the targets farther out
+    whose slope lies in ((2j - 1) / 2k, (2j + 1) / 2k]. The engine sweeps each octant outward one column at a
+    time, keeping these shadows as a sorted list of merged slope intervals, and a cell is in
+    sight when it neither blocks nor has its slope inside a shadow. This is shadowcasting with
+    Bresenham-shaped shadows, so the result matches is_line_of_sight cell for cell
+    (catacombs_bench --verify checks this on random windows).
+
+    view is the window to look through, radius is a Manhattan distance of at most VIEW_RADIUS,
+    and los receives a set bit for every cell in sight (the origin included). The shadow lists
+    are sized for VIEW_RADIUS and live on the stack.
+
+    Returns:
+        0 on success
+        1 if the origin is outside the window or the radius is too large
+*/
+// A shadow list never holds more intervals than there are cells in an octant
+#define FOV_SHADOW_CAPACITY ((VIEW_RADIUS + 1) * (VIEW_RADIUS + 2) / 2 + 1)
+
+// A shadow, the slope interval (lo, hi]. Both ends are fractions with positive denominators.
+struct fov_shadow {
+    int lo_num, lo_den;
+    int hi_num, hi_den;
+};
+
+// 1 if a / b < c / d for positive b and d
+static int fov_slope_less(int a, int b, int c, int d) {
+    return (long)a * d < (long)c * b;
+}
+
+
+// Sweeps one octant. Targets with a zero offset belong to the negative side, as in is_line_of_sight.
+static void fov_octant(const struct view_window* view, int origin_x, int origin_y, int radius,
+                       int sx, int sy, int y_major, view_row* los,
+                       struct fov_shadow* shadows, struct fov_shadow* merged, struct fov_shadow* pending) {
+    int count = 0;
+    for (int k = 1; k <= radius; k++) {
+        int pending_count = 0;
+        int s = 0;
+        for (int j = 0; j <= k && k + j <= radius; j++) {
+            int x = origin_x + sx * (y_major ? j : k);
+            int y = origin_y + sy * (y_major ? k : j);
+            if (x < 0 || x >= VIEW_SIZE || y < 0 || y >= VIEW_SIZE) continue;
+            // the slope j / k only grows along the column, so the shadow walk only moves forward
+            while (s < count && fov_slope_less(shadows[s].hi_num, shadows[s].hi_den, j, k)) s++;
+            int shadowed = s < count && fov_slope_less(shadows[s].lo_num, shadows[s].lo_den, j, k);
+            int blocked = view->blocks[RAY_QUADRANT(sx, sy)][y] >> x & 1;
+            // diagonal cells belong to the x-major octant, axis cells to the negative quadrant
+            int owned = (y_major ? j < k && (sx < 0 || j > 0) : (sy < 0 || j > 0));
+            if (owned && !shadowed && !blocked) {
+                los[y] |= (view_row)1 << x;
+            }
+            if (blocked) {
+                struct fov_shadow shadow = {2 * j - 1, 2 * k, 2 * j + 1, 2 * k};
+                pending[pending_count++] = shadow;
             }
         }
-    }
-    // Reveal floors adjacent to direct LOS floors
-    for (int y = 0; y < 21; y++) {
-        for (int x = 0; x < 21; x++) {
-            if (direct_los[y][x] == 1) {
-                for (int dy = -1; dy <= 1; dy++) {
-                    for (int dx = -1; dx <= 1; dx++) {
-                        if (dx == 0 && dy == 0) continue;
-                        int nx = x + dx, ny = y + dy;
-                        if (nx >= 0 && nx < 21 && ny >= 0 && ny < 21 && (map[ny][nx] == 0 || map[ny][nx] == 2 || map[ny][nx] == 3)) {
-                            visibility[ny][nx] = 1;
-                        }
-                    }
+        if (pending_count == 0) continue;
+
+        // Merge this column's shadows into the sorted list
+        int merged_count = 0, a = 0, b = 0;
+        while (a < count || b < pending_count) {
+            struct fov_shadow next;
+            if (b >= pending_count || (a < count && !fov_slope_less(pending[b].lo_num, pending[b].lo_den, shadows[a].lo_num, shadows[a].lo_den))) {
+                next = shadows[a++];
+            } else {
+                next = pending[b++];
+            }
+            struct fov_shadow* last = merged_count ? &merged[merged_count - 1] : NULL;
+            if (last && !fov_slope_less(last->hi_num, last->hi_den, next.lo_num, next.lo_den)) {
+                // overlapping or touching, extend the last shadow
+                if (fov_slope_less(last->hi_num, last->hi_den, next.hi_num, next.hi_den)) {
+                    last->hi_num = next.hi_num;
+                    last->hi_den = next.hi_den;
                 }
+            } else {
+                merged[merged_count++] = next;
             }
         }
+        memcpy(shadows, merged, sizeof(struct fov_shadow) * merged_count);
+        count = merged_count;
+        // Stop once one shadow covers every slope from 0 to 1
+        if (count == 1 && shadows[0].lo_num < 0 && !fov_slope_less(shadows[0].hi_num, shadows[0].hi_den, 1, 1)) {
+            break;
+        }
+    }
+}
+
+int field_of_view(const struct view_window* view, int origin_x, int origin_y, int radius, view_row los[VIEW_SIZE]) {
+    memset(los, 0, sizeof(view_row) * VIEW_SIZE);
+    if (origin_x < 0 || origin_x >= VIEW_SIZE || origin_y < 0 || origin_y >= VIEW_SIZE || radius > VIEW_RADIUS) return 1;
+    los[origin_y] = (view_row)1 << origin_x;
+    if (radius < 1) return 0;
+    struct fov_shadow shadows[FOV_SHADOW_CAPACITY], merged[FOV_SHADOW_CAPACITY], pending[VIEW_RADIUS + 1];
+    for (int quadrant = 0; quadrant < 4; quadrant++) {
+        int sx = (quadrant & 1) ? 1 : -1;
+        int sy = (quadrant & 2) ? 1 : -1;
+        for (int y_major = 0; y_major < 2; y_major++) {
+            fov_octant(view, origin_x, origin_y, radius, sx, sy, y_major, los, shadows, merged, pending);
+        }
+    }
+    return 0;
+}
+
+// Top-left corner of the view window around (center_x, center_y), kept inside the map
+void view_origin(const struct game_map* map, int center_x, int center_y, int* start_x, int* start_y) {
+    int x = center_x - VIEW_RADIUS, y = center_y - VIEW_RADIUS;
+    // Ensure the section does not go out of bounds
+    if (x + VIEW_SIZE > map->width) x = map->width - VIEW_SIZE;
+    if (y + VIEW_SIZE > map->height) y = map->height - VIEW_SIZE;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    *start_x = x;
+    *start_y = y;
+}
+
+// Fills the window masks from the map section whose top-left corner is (start_x, start_y)
+void build_view_window(const struct game_map* map, struct view_window* view, int start_x, int start_y) {
+    for (int y = 0; y < VIEW_SIZE; y++) {
+        const unsigned char* row = &MAP_AT(map, start_x, start_y + y);
+        view_row wall = 0, floor = 0, hiding = 0, chest = 0;
+        for (int x = 0; x < VIEW_SIZE; x++) {
+            view_row bit = (view_row)1 << x;
+            wall |= row[x] == 1 ? bit : 0;
+            floor |= row[x] == 0 ? bit : 0;
+            hiding |= row[x] == 2 ? bit : 0;
+            chest |= row[x] == 3 ? bit : 0;
+        }
+        view->wall[y] = wall;
+        view->floor[y] = floor;
+        view->hiding[y] = hiding;
+        view->chest[y] = chest;
+    }
+    build_view_blockers(view);
+}
+
+// Grows a row bitset by one cell in all 8 directions, clipped to the window
+static void view_dilate(const view_row* rows, view_row* out) {
+    for (int y = 0; y < VIEW_SIZE; y++) {
+        view_row band = rows[y] | (y > 0 ? rows[y - 1] : 0) | (y + 1 < VIEW_SIZE ? rows[y + 1] : 0);
+        out[y] = (band | band << 1 | band >> 1) & VIEW_ROW_MASK;
+    }
+}
+
+/*
+    Fills visibility with the cells the player at (origin_x, origin_y) of the window can see.
+
+    Returns:
+        0 on success
+        1 if the origin is outside the window
+*/
+int line_of_sight(const struct view_window* view, view_row visibility[VIEW_SIZE], int origin_x, int origin_y) {
+    view_row los[VIEW_SIZE], direct_los[VIEW_SIZE], near[VIEW_SIZE];
+    if (field_of_view(view, origin_x, origin_y, VIEW_RADIUS, los) != 0) {
+        return 1;
+    }
+    // Only floors in direct line of sight are revealed directly
+    for (int y = 0; y < VIEW_SIZE; y++) {
+        direct_los[y] = los[y] & view->floor[y];
+    }
+    // Both reveal passes grow the directly seen floors by one cell. Growing a cell onto itself
+    // changes nothing, since it is a floor that is already visible.
+    view_dilate(direct_los, near);
+    for (int y = 0; y < VIEW_SIZE; y++) {
+        visibility[y] = direct_los[y]
+                      | (near[y] & view->wall[y]) // Reveal walls adjacent to revealed floors
+                      | (near[y] & (view->floor[y] | view->hiding[y] | view->chest[y])); // Reveal floors adjacent to direct LOS floors
     }
     // Ensure the origin (player's position) is always visible
-    visibility[cy][cx] = 1;
-}
\ No newline at end of file
+    visibility[origin_y] |= (view_row)1 << origin_x;
+    return 0;
+}
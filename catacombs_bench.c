@@ -0,0 +1,511 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+    Catacombs benchmark suite
+
+    Builds the map generator and the game into one program (each with its main renamed) and
+    times their hot paths on fixed-seed maps, from 50x50 up to 8192x8192:
+        generate_catacomb_map  a fresh map, allocation included
+        connect_components     on a generated (already connected) map
+        save_map_to_file       binary map written to a scratch file
+        load_map_from_file     the scratch file mapped back in, messages written to /dev/null
+        line_of_sight          the visibility of a whole view window
+        is_line_of_sight       one line from the player to a cell of the window
+        render_game            a full frame, written to /dev/null
+
+    Each operation is repeated, doubling the batch, until a batch takes at least --min-ms.
+    For every operation and size it reports ns/op, heap bytes requested per op (malloc, calloc
+    and realloc calls from the game and generator code are counted), and the peak RSS of the
+    process so far. Results are written as JSON (--out, bench.json by default) so runs of
+    different builds can be diffed; a summary is printed as well.
+
+    --verify WINDOWS times nothing. It checks the line of sight code instead, on that many
+    random view windows, against the original cell-by-cell Bresenham walk (see bench_verify).
+
+    Usage: catacombs_bench [--seed N] [--sizes 50,256,...] [--min-ms MS] [--out FILE] [--verify WINDOWS]
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Heap requests made by the code below are counted
+static uint64_t bench_heap_bytes = 0;
+
+static void* bench_malloc(size_t size) {
+    bench_heap_bytes += size;
+    return malloc(size);
+}
+
+static void* bench_calloc(size_t count, size_t size) {
+    bench_heap_bytes += count * size;
+    return calloc(count, size);
+}
+
+static void* bench_realloc(void* block, size_t size) {
+    bench_heap_bytes += size;
+    return realloc(block, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(block, size) bench_realloc(block, size)
+
+#define main generator_main
+#include "catacomb_generator.c"
+#undef main
+#undef MAP_AT
+
+#define main game_main
+#include "catacombs.c"
+#undef main
+
+#define BENCH_DEFAULT_SEED 1
+#define BENCH_DEFAULT_MIN_MS 300
+#define BENCH_MAX_SIZES 16
+#define BENCH_SCRATCH "catacombs_bench_scratch" // save_map_to_file adds .catamap
+#define BENCH_WINDOWS 64   // player positions the view benchmarks cycle through
+#define BENCH_TARGETS 1024 // cells is_line_of_sight is asked about
+
+static const int bench_default_sizes[] = {50, 256, 1024, 4096, 8192};
+
+// State the benchmarked operations work on
+struct bench_state {
+    int width, height;
+    struct catarng rng;
+    uint64_t seed;
+    struct catamap map; // generator side
+    struct game_map loaded; // game side, loaded back from the scratch file
+    struct game_session game; // just enough of a game for the view benchmarks
+    struct view_window windows[BENCH_WINDOWS];
+    int origins[BENCH_WINDOWS][2]; // player's cell inside each window
+    int positions[BENCH_WINDOWS][2]; // player's map position for each window
+    int targets[BENCH_TARGETS][2];
+    size_t next;
+    int sink; // keeps results alive
+};
+
+struct bench_result {
+    char op[32];
+    int width, height;
+    uint64_t iterations;
+    double ns_per_op;
+    double bytes_per_op;
+    long peak_rss_kb;
+};
+
+static struct bench_result bench_results[BENCH_MAX_SIZES * 8];
+static int bench_result_count = 0;
+static int bench_min_ms = BENCH_DEFAULT_MIN_MS;
+
+static long peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss; // kilobytes on Linux
+}
+
+/*
+    Times op, doubling the batch until one takes at least bench_min_ms, and records the result.
+
+    Returns:
+        0 on success
+        1 if the operation failed
+*/
+static int bench_run(const char* name, struct bench_state* state, int (*op)(struct bench_state*)) {
+    uint64_t batch = 1;
+    for (;;) {
+        uint64_t heap_before = bench_heap_bytes;
+        uint64_t started = clock_ns();
+        for (uint64_t i = 0; i < batch; i++) {
+            if (op(state) != 0) {
+                fprintf(stderr, "%s failed at %dx%d\n", name, state->width, state->height);
+                return 1;
+            }
+        }
+        uint64_t elapsed = clock_ns() - started;
+        if (elapsed >= (uint64_t)bench_min_ms * 1000000ULL || batch >= (1ULL << 40)) {
+            struct bench_result* result = &bench_results[bench_result_count++];
+            snprintf(result->op, sizeof(result->op), "%s", name);
+            result->width = state->width;
+            result->height = state->height;
+            result->iterations = batch;
+            result->ns_per_op = (double)elapsed / (double)batch;
+            result->bytes_per_op = (double)(bench_heap_bytes - heap_before) / (double)batch;
+            result->peak_rss_kb = peak_rss_kb();
+            fprintf(stderr, "%-22s %5dx%-5d %14.1f ns/op %14.0f B/op %10ld KB peak RSS (%llu ops)\n", name,
+                    state->width, state->height, result->ns_per_op, result->bytes_per_op, result->peak_rss_kb,
+                    (unsigned long long)batch);
+            return 0;
+        }
+        batch *= 2;
+    }
+}
+
+static int op_generate(struct bench_state* state) {
+    // the same seed every time, on a fresh map like a single generator run
+    catamap_close(&state->map);
+    catarng_seed(&state->rng, state->seed);
+    return generate_catacomb_map(&state->map, &state->rng, state->width, state->height);
+}
+
+static int op_connect(struct bench_state* state) {
+    return connect_components(&state->map, state->width, state->height);
+}
+
+static int op_save(struct bench_state* state) {
+    return save_map_to_file(&state->map, BENCH_SCRATCH);
+}
+
+static int op_load(struct bench_state* state) {
+    close_map(&state->loaded);
+    return load_map_from_file(&state->loaded, BENCH_SCRATCH ".catamap");
+}
+
+static int op_line_of_sight(struct bench_state* state) {
+    size_t w = state->next++ % BENCH_WINDOWS;
+    view_row visibility[VIEW_SIZE];
+    if (line_of_sight(&state->windows[w], visibility, state->origins[w][0], state->origins[w][1]) != 0) return 1;
+    state->sink += (int)(visibility[VIEW_RADIUS] & 1);
+    return 0;
+}
+
+static int op_is_line_of_sight(struct bench_state* state) {
+    size_t n = state->next++;
+    size_t w = n % BENCH_WINDOWS;
+    const int* target = state->targets[n % BENCH_TARGETS];
+    state->sink += is_line_of_sight(&state->windows[w], state->origins[w][0], state->origins[w][1], target[0], target[1]);
+    return 0;
+}
+
+static int op_render(struct bench_state* state) {
+    size_t w = state->next++ % BENCH_WINDOWS;
+    state->game.player_x = state->positions[w][0];
+    state->game.player_y = state->positions[w][1];
+    return render_game(&state->game);
+}
+
+// Picks the player positions and line targets for the view benchmarks on the loaded map
+static int bench_prepare_views(struct bench_state* state) {
+    const struct game_map* map = &state->loaded;
+    struct game_session* game = &state->game;
+    if (floor_index_build(&state->loaded) != 0) return 1;
+    game->map = map;
+    game->out = stdout;
+    for (int w = 0; w < BENCH_WINDOWS; w++) {
+        int x, y, start_x, start_y;
+        if (sample_floor_tile(&map->floor_index, &game->rng, NULL, &x, &y) != 0) return 1;
+        view_origin(map, x, y, &start_x, &start_y);
+        build_view_window(map, &state->windows[w], start_x, start_y);
+        state->positions[w][0] = x;
+        state->positions[w][1] = y;
+        state->origins[w][0] = x - start_x;
+        state->origins[w][1] = y - start_y;
+    }
+    int span_x = map->width < VIEW_SIZE ? map->width : VIEW_SIZE;
+    int span_y = map->height < VIEW_SIZE ? map->height : VIEW_SIZE;
+    for (int t = 0; t < BENCH_TARGETS; t++) {
+        state->targets[t][0] = random_number_range(&game->rng, 0, span_x - 1);
+        state->targets[t][1] = random_number_range(&game->rng, 0, span_y - 1);
+    }
+    // a few entities around for the renderer to draw
+    struct entity_set* entities = &game->entities;
+    if (entities_alloc(entities, BENCH_WINDOWS, map) != 0) return 1;
+    for (int i = 0; i < entities->count; i++) {
+        entities->x[i] = state->positions[i][0] + (i % 2 ? 2 : -2);
+        entities->y[i] = state->positions[i][1];
+        if (!tile_walkable(map, entities->x[i], entities->y[i])) {
+            entities->x[i] = state->positions[i][0];
+        }
+    }
+    entity_grid_rebuild(entities);
+    return 0;
+}
+
+/*
+    bench_run for an operation that prints (map loading messages, frames): its stdout goes to
+    /dev/null while it runs, so the output neither floods the terminal nor waits on it.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static int bench_run_quiet(const char* name, struct bench_state* state, int (*op)(struct bench_state*)) {
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    int failed = 1;
+    if (saved_stdout >= 0 && null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        failed = bench_run(name, state, op);
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+    }
+    if (null_fd >= 0) close(null_fd);
+    if (saved_stdout >= 0) close(saved_stdout);
+    return failed;
+}
+
+static int bench_size(int width, int height, uint64_t seed) {
+    struct bench_state* state = calloc(1, sizeof(*state));
+    if (state == NULL) return 1;
+    state->width = width;
+    state->height = height;
+    state->seed = seed;
+    catarng_seed(&state->game.rng, seed);
+
+    int failed = bench_run("generate_catacomb_map", state, op_generate) ||
+                 bench_run("connect_components", state, op_connect) ||
+                 bench_run("save_map_to_file", state, op_save) ||
+                 bench_run_quiet("load_map_from_file", state, op_load) ||
+                 bench_prepare_views(state) ||
+                 bench_run("line_of_sight", state, op_line_of_sight) ||
+                 bench_run("is_line_of_sight", state, op_is_line_of_sight) ||
+                 bench_run_quiet("render_game", state, op_render);
+
+    catamap_close(&state->map);
+    close_map(&state->loaded);
+    entities_free(&state->game.entities);
+    remove(BENCH_SCRATCH ".catamap");
+    free(state);
+    return failed;
+}
+
+/*
+    Line of sight reference
+
+    The original game tested every cell of the view window with its own Bresenham walk over
+    the tiles. These two functions are that code, kept as the reference the table-driven
+    is_line_of_sight and the shadowcasting field_of_view must match.
+*/
+static int reference_is_line_of_sight(const unsigned char tiles[VIEW_SIZE][VIEW_SIZE], int x1, int y1, int x2, int y2) {
+    if (x1 == x2 && y1 == y2) return 1;
+    int dx = abs(x2 - x1);
+    int dy = abs(y2 - y1);
+    int sx = x1 < x2 ? 1 : -1;
+    int sy = y1 < y2 ? 1 : -1;
+    int err = dx - dy;
+    int x = x1, y = y1;
+    for (;;) {
+        if (x != x1 || y != y1) {
+            // diagonal squeeze between two walls or two hiding spots, toward either step
+            int adj_x = x + sx, adj_y = y + sy;
+            if (adj_x >= 0 && adj_x < VIEW_SIZE && adj_y >= 0 && adj_y < VIEW_SIZE) {
+                if (tiles[adj_y][x] == TILE_WALL && tiles[y][adj_x] == TILE_WALL) return 0;
+                if (tiles[adj_y][x] == TILE_HIDING_SPOT && tiles[y][adj_x] == TILE_HIDING_SPOT) return 0;
+            }
+            int prev_x = x - sx, prev_y = y - sy;
+            if (prev_x >= 0 && prev_x < VIEW_SIZE && prev_y >= 0 && prev_y < VIEW_SIZE) {
+                if (tiles[prev_y][x] == TILE_WALL && tiles[y][prev_x] == TILE_WALL) return 0;
+                if (tiles[prev_y][x] == TILE_HIDING_SPOT && tiles[y][prev_x] == TILE_HIDING_SPOT) return 0;
+            }
+            if (tiles[y][x] == TILE_WALL) return 0;
+        }
+        if (x == x2 && y == y2) break;
+        int e2 = 2 * err;
+        if (e2 > -dy) {
+            err -= dy;
+            x += sx;
+        }
+        if (e2 < dx) {
+            err += dx;
+            y += sy;
+        }
+    }
+    return 1;
+}
+
+// Marks what the player at (ox, oy) sees, with the reveal passes of the original game
+static void reference_line_of_sight(const unsigned char tiles[VIEW_SIZE][VIEW_SIZE], unsigned char visibility[VIEW_SIZE][VIEW_SIZE], int ox, int oy) {
+    unsigned char direct[VIEW_SIZE][VIEW_SIZE] = {{0}};
+    memset(visibility, 0, VIEW_SIZE * VIEW_SIZE);
+    for (int y = 0; y < VIEW_SIZE; y++) {
+        for (int x = 0; x < VIEW_SIZE; x++) {
+            if (abs(x - ox) + abs(y - oy) > VIEW_RADIUS) continue;
+            if (tiles[y][x] == TILE_FLOOR && reference_is_line_of_sight(tiles, ox, oy, x, y)) {
+                visibility[y][x] = 1;
+                direct[y][x] = 1;
+            }
+        }
+    }
+    // walls next to seen floors, then anything but walls next to them
+    for (int pass = 0; pass < 2; pass++) {
+        for (int y = 0; y < VIEW_SIZE; y++) {
+            for (int x = 0; x < VIEW_SIZE; x++) {
+                if (!direct[y][x]) continue;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = x + dx, ny = y + dy;
+                        if (nx < 0 || nx >= VIEW_SIZE || ny < 0 || ny >= VIEW_SIZE) continue;
+                        if ((tiles[ny][nx] == TILE_WALL) == (pass == 0)) visibility[ny][nx] = 1;
+                    }
+                }
+            }
+        }
+    }
+    visibility[oy][ox] = 1;
+}
+
+/*
+    Builds random view windows, with wall and hiding spot densities that vary from window to
+    window, and compares field_of_view, line_of_sight and is_line_of_sight against the
+    reference for a random origin in each (the centered origin every other window, since
+    is_line_of_sight takes a faster path there). Every cell of every window is compared.
+
+    Returns:
+        0 if everything matched
+        1 on the first mismatch (printed to stderr)
+*/
+static int bench_verify(uint64_t seed, long windows) {
+    struct catarng rng;
+    catarng_seed(&rng, seed);
+    init_ray_tables();
+    for (long w = 0; w < windows; w++) {
+        unsigned char tiles[VIEW_SIZE][VIEW_SIZE];
+        int wall_percent = random_number_range(&rng, 0, 70);
+        int hiding_percent = random_number_range(&rng, 0, 20);
+        struct view_window view;
+        memset(&view, 0, sizeof(view));
+        for (int y = 0; y < VIEW_SIZE; y++) {
+            for (int x = 0; x < VIEW_SIZE; x++) {
+                int roll = random_number_range(&rng, 0, 99);
+                int tile = roll < wall_percent ? TILE_WALL
+                         : roll < wall_percent + hiding_percent ? TILE_HIDING_SPOT
+                         : roll == 99 ? TILE_TREASURE_CHEST : TILE_FLOOR;
+                tiles[y][x] = (unsigned char)tile;
+                view_row bit = (view_row)1 << x;
+                if (tile == TILE_WALL) view.wall[y] |= bit;
+                if (tile == TILE_FLOOR) view.floor[y] |= bit;
+                if (tile == TILE_HIDING_SPOT) view.hiding[y] |= bit;
+                if (tile == TILE_TREASURE_CHEST) view.chest[y] |= bit;
+            }
+        }
+        build_view_blockers(&view);
+        int ox = VIEW_RADIUS, oy = VIEW_RADIUS;
+        if (w % 2) {
+            ox = random_number_range(&rng, 0, VIEW_SIZE - 1);
+            oy = random_number_range(&rng, 0, VIEW_SIZE - 1);
+        }
+
+        view_row los[VIEW_SIZE], visibility[VIEW_SIZE];
+        unsigned char expected[VIEW_SIZE][VIEW_SIZE];
+        if (field_of_view(&view, ox, oy, VIEW_RADIUS, los) != 0 || line_of_sight(&view, visibility, ox, oy) != 0) {
+            fprintf(stderr, "Window %ld: line of sight failed for origin (%d, %d)\n", w, ox, oy);
+            return 1;
+        }
+        reference_line_of_sight(tiles, expected, ox, oy);
+        for (int y = 0; y < VIEW_SIZE; y++) {
+            for (int x = 0; x < VIEW_SIZE; x++) {
+                int line = reference_is_line_of_sight(tiles, ox, oy, x, y);
+                int in_range = abs(x - ox) + abs(y - oy) <= VIEW_RADIUS;
+                const char* what = NULL;
+                if (is_line_of_sight(&view, ox, oy, x, y) != line) {
+                    what = "is_line_of_sight";
+                } else if ((int)(los[y] >> x & 1) != (in_range && line)) {
+                    what = "field_of_view";
+                } else if ((int)(visibility[y] >> x & 1) != expected[y][x]) {
+                    what = "line_of_sight";
+                }
+                if (what != NULL) {
+                    fprintf(stderr, "Window %ld (seed %llu): %s differs from the reference at (%d, %d) seen from (%d, %d)\n",
+                            w, (unsigned long long)seed, what, x, y, ox, oy);
+                    return 1;
+                }
+            }
+        }
+    }
+    fprintf(stderr, "Line of sight matches the reference on %ld windows\n", windows);
+    return 0;
+}
+
+/*
+    Writes every result as JSON.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static int bench_write_json(const char* filename, uint64_t seed) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        perror("Error opening benchmark output");
+        return 1;
+    }
+    fprintf(file, "{\n  \"seed\": %llu,\n  \"min_ms\": %d,\n  \"results\": [", (unsigned long long)seed, bench_min_ms);
+    for (int r = 0; r < bench_result_count; r++) {
+        const struct bench_result* result = &bench_results[r];
+        fprintf(file, "%s\n    {\"op\": \"%s\", \"width\": %d, \"height\": %d, \"iterations\": %llu, "
+                      "\"ns_per_op\": %.1f, \"bytes_per_op\": %.0f, \"peak_rss_kb\": %ld}",
+                r > 0 ? "," : "", result->op, result->width, result->height,
+                (unsigned long long)result->iterations, result->ns_per_op, result->bytes_per_op, result->peak_rss_kb);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    if (fclose(file) != 0) {
+        perror("Error writing benchmark output");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t seed = BENCH_DEFAULT_SEED;
+    const char* out = "bench.json";
+    long verify_windows = 0; // --verify, 0 to run the benchmarks
+    int sizes[BENCH_MAX_SIZES];
+    int size_count = (int)(sizeof(bench_default_sizes) / sizeof(bench_default_sizes[0]));
+    memcpy(sizes, bench_default_sizes, sizeof(bench_default_sizes));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            if (catarng_parse_seed(argv[++i], &seed) != 0) {
+                fprintf(stderr, "Invalid seed: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            size_count = 0;
+            for (char* item = strtok(argv[++i], ","); item != NULL && size_count < BENCH_MAX_SIZES; item = strtok(NULL, ",")) {
+                sizes[size_count] = atoi(item);
+                if (sizes[size_count] < 12) {
+                    fprintf(stderr, "Invalid size: %s (at least 12)\n", item);
+                    return 1;
+                }
+                size_count++;
+            }
+        } else if (strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc) {
+            bench_min_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {
+            verify_windows = atol(argv[++i]);
+            if (verify_windows <= 0) {
+                fprintf(stderr, "Invalid window count: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--seed N] [--sizes 50,256,...] [--min-ms MS] [--out FILE] [--verify WINDOWS]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (verify_windows > 0) {
+        return bench_verify(seed, verify_windows);
+    }
+    init_ray_tables();
+    for (int s = 0; s < size_count; s++) {
+        if (bench_size(sizes[s], sizes[s], seed) != 0) {
+            return 1;
+        }
+    }
+    if (bench_write_json(out, seed) != 0) {
+        return 1;
+    }
+    fprintf(stderr, "Results written to %s\n", out);
+    return 0;
+}
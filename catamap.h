@@ -0,0 +1,301 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+    Catacombs binary map format (.catamap)
+
+    Shared by the map generator and the game. The generator writes this format,
+    and the game maps it straight into memory and reads the tiles in place.
+
+    Layout (version 1, little-endian):
+        offset  size  field
+        0       8     magic, "CATAMAP" followed by a NUL byte
+        8       4     format version
+        12      4     header size in bytes (offset of the tile payload)
+        16      4     map width
+        20      4     map height
+        24      8     checksum of the tile payload
+        32      w*h   tiles, one byte each (0-3), row-major
+
+    Header fields are written and read byte by byte (catamap_header_encode/decode),
+    and the checksum reads its words as little-endian too, so a file means the same
+    on any machine.
+
+    Files that do not start with the magic are treated as the older text format
+    by the game's map loader.
+
+    In memory both programs keep the map as one contiguous grid of bytes, indexed by
+    row stride (see CATAMAP_AT). A grid is either a read-only file mapping or a single
+    heap block, and catamap_close releases either with one call.
+*/
+
+#ifndef CATAMAP_H
+#define CATAMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CATAMAP_MAGIC "CATAMAP"
+#define CATAMAP_VERSION 1
+#define CATAMAP_HEADER_SIZE 32 // bytes of the header on disk
+
+// Tile values
+#define TILE_FLOOR 0
+#define TILE_WALL 1
+#define TILE_HIDING_SPOT 2
+#define TILE_TREASURE_CHEST 3
+
+struct catamap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t width;
+    uint32_t height;
+    uint64_t checksum;
+};
+
+// Little-endian integers in a byte buffer
+static inline uint32_t catamap_get_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t catamap_get_le64(const unsigned char* p) {
+    return (uint64_t)catamap_get_le32(p) | (uint64_t)catamap_get_le32(p + 4) << 32;
+}
+
+static inline void catamap_put_le32(unsigned char* p, uint32_t value) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static inline void catamap_put_le64(unsigned char* p, uint64_t value) {
+    catamap_put_le32(p, (uint32_t)value);
+    catamap_put_le32(p + 4, (uint32_t)(value >> 32));
+}
+
+// Header in its on-disk layout
+static inline void catamap_header_encode(const struct catamap_header* header, unsigned char out[CATAMAP_HEADER_SIZE]) {
+    memcpy(out, header->magic, sizeof(header->magic));
+    catamap_put_le32(out + 8, header->version);
+    catamap_put_le32(out + 12, header->header_size);
+    catamap_put_le32(out + 16, header->width);
+    catamap_put_le32(out + 20, header->height);
+    catamap_put_le64(out + 24, header->checksum);
+}
+
+static inline void catamap_header_decode(const unsigned char in[CATAMAP_HEADER_SIZE], struct catamap_header* header) {
+    memcpy(header->magic, in, sizeof(header->magic));
+    header->version = catamap_get_le32(in + 8);
+    header->header_size = catamap_get_le32(in + 12);
+    header->width = catamap_get_le32(in + 16);
+    header->height = catamap_get_le32(in + 20);
+    header->checksum = catamap_get_le64(in + 24);
+}
+
+// A map grid. Tiles either point into a read-only file mapping or into a heap block.
+struct catamap {
+    int width;
+    int height;
+    size_t stride;  // bytes per row, currently always the width so grids can be written as-is
+    const unsigned char* tiles;
+    unsigned char* cells;  // the same tiles, writable; NULL for file mappings
+    void* base;     // start of the mapping or heap block
+    size_t length;  // length of the mapping, 0 for heap blocks
+};
+
+// Tile at (x, y), read-only
+#define CATAMAP_AT(map, x, y) ((map)->tiles[(size_t)(y) * (map)->stride + (size_t)(x)])
+
+// Assignable tile at (x, y), heap-backed grids only
+#define CATAMAP_CELL(map, x, y) ((map)->cells[(size_t)(y) * (map)->stride + (size_t)(x)])
+
+// 64-bit FNV-1a variant that folds in a whole word per step
+static inline uint64_t catamap_checksum(const unsigned char* data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        hash = (hash ^ catamap_get_le64(data + i)) * 0x100000001b3ULL;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Returns 1 if the first bytes of a file identify a binary map
+static inline int catamap_is_binary(const char* magic, size_t length) {
+    return length >= sizeof(((struct catamap_header*)0)->magic) &&
+           memcmp(magic, CATAMAP_MAGIC, sizeof(CATAMAP_MAGIC)) == 0;
+}
+
+/*
+    Allocates a heap-backed grid of the given size in a single block, filled with walls.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static inline int catamap_alloc(struct catamap* map, int width, int height) {
+    memset(map, 0, sizeof(*map));
+    size_t size = (size_t)width * (size_t)height;
+    map->base = malloc(size);
+    if (map->base == NULL) {
+        return 1;
+    }
+    memset(map->base, TILE_WALL, size);
+    map->width = width;
+    map->height = height;
+    map->stride = (size_t)width;
+    map->cells = (unsigned char*)map->base;
+    map->tiles = map->cells;
+    return 0;
+}
+
+/*
+    Writes a binary map with one byte per tile (0-3).
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static inline int catamap_write(const char* filename, const struct catamap* map) {
+    struct catamap_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CATAMAP_MAGIC, sizeof(CATAMAP_MAGIC));
+    header.version = CATAMAP_VERSION;
+    header.header_size = CATAMAP_HEADER_SIZE;
+    header.width = (uint32_t)map->width;
+    header.height = (uint32_t)map->height;
+    size_t payload = (size_t)map->width * (size_t)map->height;
+    header.checksum = catamap_checksum(map->tiles, payload);
+
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        return 1;
+    }
+    unsigned char encoded[CATAMAP_HEADER_SIZE];
+    catamap_header_encode(&header, encoded);
+    int failed = fwrite(encoded, 1, sizeof(encoded), file) != sizeof(encoded) ||
+                 fwrite(map->tiles, 1, payload, file) != payload;
+    if (fclose(file) != 0) {
+        failed = 1;
+    }
+    return failed;
+}
+
+// Releases a grid from catamap_open or catamap_alloc
+static inline void catamap_close(struct catamap* map) {
+#ifndef _WIN32
+    if (map->length > 0) {
+        munmap(map->base, map->length);
+    } else {
+        free(map->base);
+    }
+#else
+    free(map->base);
+#endif
+    memset(map, 0, sizeof(*map));
+}
+
+/*
+    Maps a binary map file into memory. The tiles are used in place, nothing is parsed
+    or copied. The header and payload checksum are validated before returning.
+
+    Returns:
+        0 on success
+        1 on failure (message printed to stderr)
+*/
+static inline int catamap_open(const char* filename, struct catamap* map) {
+    memset(map, 0, sizeof(*map));
+    void* base;
+    size_t length;
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening map file");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < CATAMAP_HEADER_SIZE) {
+        fprintf(stderr, "Map file %s is truncated\n", filename);
+        close(fd);
+        return 1;
+    }
+    length = (size_t)st.st_size;
+    base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Error mapping map file");
+        return 1;
+    }
+#else
+    // No mmap on Windows, read the whole file into one heap block instead
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror("Error opening map file");
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < CATAMAP_HEADER_SIZE) {
+        fprintf(stderr, "Map file %s is truncated\n", filename);
+        fclose(file);
+        return 1;
+    }
+    length = (size_t)size;
+    base = malloc(length);
+    if (base == NULL || fread(base, 1, length, file) != length) {
+        perror("Error reading map file");
+        free(base);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+#endif
+    map->base = base;
+#ifndef _WIN32
+    map->length = length;
+#endif
+
+    struct catamap_header header;
+    catamap_header_decode((const unsigned char*)base, &header);
+    size_t payload = (size_t)header.width * (size_t)header.height;
+    const char* error = NULL;
+    if (!catamap_is_binary(header.magic, sizeof(header.magic))) {
+        error = "not a binary map";
+    } else if (header.version != CATAMAP_VERSION) {
+        error = "unsupported map version";
+    } else if (header.header_size < CATAMAP_HEADER_SIZE || header.width == 0 || header.height == 0 ||
+               header.width > INT32_MAX / header.height) {
+        error = "invalid header";
+    } else if (header.header_size > length || length - header.header_size < payload) {
+        error = "truncated tile data";
+    } else if (catamap_checksum((const unsigned char*)base + header.header_size, payload) != header.checksum) {
+        error = "checksum mismatch";
+    }
+    if (error) {
+        fprintf(stderr, "Invalid map file %s: %s\n", filename, error);
+        catamap_close(map);
+        return 1;
+    }
+
+    map->width = (int)header.width;
+    map->height = (int)header.height;
+    map->stride = header.width;
+    map->tiles = (unsigned char*)base + header.header_size;
+    return 0;
+}
+
+#endif // CATAMAP_H
@@ -0,0 +1,107 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+    Catacombs random number generation
+
+    Shared by the map generator and the game. Every random call takes an explicit
+    generator state, so a run is fully determined by its seed and separate states can
+    be used from separate threads.
+
+    The generator is xoshiro256** (Blackman & Vigna), seeded through splitmix64 so any
+    64-bit seed, including 0, gives a well-mixed starting state.
+*/
+
+#ifndef CATARNG_H
+#define CATARNG_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct catarng {
+    uint64_t s[4];
+};
+
+static inline uint64_t catarng_splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline void catarng_seed(struct catarng* rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = catarng_splitmix64(&seed);
+    }
+}
+
+static inline uint64_t catarng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t catarng_next(struct catarng* rng) {
+    uint64_t* s = rng->s;
+    uint64_t result = catarng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = catarng_rotl(s[3], 45);
+    return result;
+}
+
+// Unbiased integer in [0, bound) using Lemire's multiply-and-reject method. bound must be > 0.
+static inline uint32_t catarng_bounded(struct catarng* rng, uint32_t bound) {
+    uint64_t m = (catarng_next(rng) >> 32) * (uint64_t)bound;
+    uint32_t low = (uint32_t)m;
+    if (low < bound) {
+        uint32_t threshold = (uint32_t)(-bound) % bound;
+        while (low < threshold) {
+            m = (catarng_next(rng) >> 32) * (uint64_t)bound;
+            low = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+// Gets a random number within the given range (inclusive)
+static inline int random_number_range(struct catarng* rng, int min, int max) {
+    uint32_t span = (uint32_t)max - (uint32_t)min + 1;
+    if (span == 0) { // the whole int range
+        return (int)(uint32_t)(catarng_next(rng) >> 32);
+    }
+    return (int)((uint32_t)min + catarng_bounded(rng, span));
+}
+
+// returns either 0 (false) or 1 (true)
+static inline int random_bool(struct catarng* rng) {
+    return (int)(catarng_next(rng) >> 63);
+}
+
+/*
+    Parses a decimal seed given on the command line.
+
+    Returns:
+        0 on success
+        1 on failure
+*/
+static inline int catarng_parse_seed(const char* text, uint64_t* seed) {
+    if (text == NULL || *text == '\0' || *text == '-') {
+        return 1;
+    }
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (*end != '\0') {
+        return 1;
+    }
+    *seed = (uint64_t)value;
+    return 0;
+}
+
+#endif // CATARNG_H
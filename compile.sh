@@ -2,8 +2,9 @@
 
 echo "Compiling Catacombs for Unix systems through GCC"
 if command -v gcc &> /dev/null; then
-    gcc -o catacomb_generator catacomb_generator.c -lm
-    gcc -o catacombs catacombs.c -lm
+    gcc -o catacomb_generator catacomb_generator.c -lm -pthread
+    gcc -o catacombs catacombs.c -lm -pthread
+    gcc -O2 -o catacombs_bench catacombs_bench.c -lm -pthread
 else
     echo "GCC does not exist on the current system. Exiting."
 fi
\ No newline at end of file